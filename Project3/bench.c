@@ -0,0 +1,215 @@
+#ifdef NPTL
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#else
+#include "threads.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+/*
+	Thread library microbenchmarks: create+join latency, yield round trips, semaphore ping-pong,
+	producer/consumer throughput and resident memory per thread as the thread count grows
+	Build it with threads.o for the green library, or with -DNPTL to compare with kernel threads
+*/
+
+#define CREATES 1000
+#define YIELDS 200000
+#define ROUND_TRIPS 100000
+#define ITEMS 500000
+#define BUFFER 10
+
+sem_t ping, pong;
+sem_t empty, full, mutex;
+sem_t hold;
+int ring[BUFFER];
+int in = 0, out = 0;
+long consumed = 0;
+
+unsigned long long now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Resident set size in bytes
+long rss()
+{
+	long pages = 0, resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (f == NULL)
+		return 0;
+	if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+		resident = 0;
+	fclose(f);
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+void *nothing(void *arg)
+{
+	return arg;
+}
+
+void *yielder(void *arg)
+{
+	int i = 0;
+	for (i = 0; i < YIELDS; i++)
+		sched_yield();
+	return NULL;
+}
+
+void *pong_player(void *arg)
+{
+	int i = 0;
+	for (i = 0; i < ROUND_TRIPS; i++)
+	{
+		sem_wait(&ping);
+		sem_post(&pong);
+	}
+	return NULL;
+}
+
+void *producer(void *arg)
+{
+	int i = 0;
+	for (i = 0; i < ITEMS; i++)
+	{
+		sem_wait(&empty);
+		sem_wait(&mutex);
+		ring[in] = i;
+		in = (in + 1) % BUFFER;
+		sem_post(&mutex);
+		sem_post(&full);
+	}
+	return NULL;
+}
+
+void *consumer(void *arg)
+{
+	int i = 0;
+	for (i = 0; i < ITEMS; i++)
+	{
+		sem_wait(&full);
+		sem_wait(&mutex);
+		consumed += ring[out] >= 0;
+		out = (out + 1) % BUFFER;
+		sem_post(&mutex);
+		sem_post(&empty);
+	}
+	return NULL;
+}
+
+// Parks until the memory has been measured
+void *holder(void *arg)
+{
+	sem_wait(&hold);
+	return NULL;
+}
+
+void bench_create()
+{
+	pthread_t t;
+	int i = 0;
+	unsigned long long start = now_ns();
+	for (i = 0; i < CREATES; i++)
+	{
+		pthread_create(&t, NULL, nothing, NULL);
+		pthread_join(t, NULL);
+	}
+	printf("create+join        %9.1f ns\n", (double)(now_ns() - start) / CREATES);
+}
+
+void bench_yield()
+{
+	pthread_t a, b;
+	unsigned long long start = now_ns();
+	pthread_create(&a, NULL, yielder, NULL);
+	pthread_create(&b, NULL, yielder, NULL);
+	pthread_join(a, NULL);
+	pthread_join(b, NULL);
+	// Every round trip is two yields, one by each thread
+	printf("yield round trip   %9.1f ns\n", (double)(now_ns() - start) / YIELDS);
+}
+
+void bench_pingpong()
+{
+	pthread_t t;
+	sem_init(&ping, 0, 0);
+	sem_init(&pong, 0, 0);
+	pthread_create(&t, NULL, pong_player, NULL);
+	unsigned long long start = now_ns();
+	int i = 0;
+	for (i = 0; i < ROUND_TRIPS; i++)
+	{
+		sem_post(&ping);
+		sem_wait(&pong);
+	}
+	printf("sem ping-pong      %9.1f ns\n", (double)(now_ns() - start) / ROUND_TRIPS);
+	pthread_join(t, NULL);
+	sem_destroy(&ping);
+	sem_destroy(&pong);
+}
+
+void bench_prodcons()
+{
+	pthread_t p, c;
+	sem_init(&empty, 0, BUFFER);
+	sem_init(&full, 0, 0);
+	sem_init(&mutex, 0, 1);
+	unsigned long long start = now_ns();
+	pthread_create(&c, NULL, consumer, NULL);
+	pthread_create(&p, NULL, producer, NULL);
+	pthread_join(p, NULL);
+	pthread_join(c, NULL);
+	printf("producer/consumer  %9.2f M items/s  (%ld items)\n", ITEMS / ((now_ns() - start) / 1e9) / 1e6, consumed);
+	sem_destroy(&empty);
+	sem_destroy(&full);
+	sem_destroy(&mutex);
+}
+
+void bench_memory(int count)
+{
+	pthread_t *t = malloc(count * sizeof(pthread_t));
+	sem_init(&hold, 0, 0);
+	long before = rss();
+	int i = 0, made = 0;
+	for (i = 0; i < count; i++)
+	{
+		if (pthread_create(&t[made], NULL, holder, NULL) != 0)
+			break;
+		made++;
+	}
+	// Let every thread run into sem_wait so its stack is touched
+	for (i = 0; i < 10; i++)
+		sched_yield();
+	long after = rss();
+
+	for (i = 0; i < made; i++)
+		sem_post(&hold);
+	for (i = 0; i < made; i++)
+		pthread_join(t[i], NULL);
+	sem_destroy(&hold);
+	free(t);
+	printf("memory %5d threads  %7.1f KiB resident per thread\n", made, made ? (after - before) / 1024.0 / made : 0.0);
+}
+
+int main()
+{
+#ifdef NPTL
+	printf("-- NPTL --\n");
+#else
+	printf("-- green threads --\n");
+#endif
+	bench_create();
+	bench_yield();
+	bench_pingpong();
+	bench_prodcons();
+	bench_memory(100);
+	bench_memory(500);
+	bench_memory(2000);
+	return 0;
+}
@@ -0,0 +1,143 @@
+#include "threads.h"
+#include <stdio.h>
+#include <time.h>
+
+/*
+	Messages per second through a producer/consumer pipeline
+	The semaphore version is the ring buffer from main.cpp (empty, full and mutex semaphores),
+	against a buffered channel, an unbuffered one and a consumer selecting over two channels
+*/
+
+#define MESSAGES 500000
+#define BUFFER 10
+
+sem_t empty, full, mutex;
+int ring[BUFFER];
+int in = 0, out = 0;
+chan *ch, *ch2;
+long sum = 0;
+
+unsigned long long now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void *sem_producer(void *arg)
+{
+	int i = 0;
+	for (i = 0; i < MESSAGES; i++)
+	{
+		sem_wait(&empty);
+		sem_wait(&mutex);
+		ring[in] = i;
+		in = (in + 1) % BUFFER;
+		sem_post(&mutex);
+		sem_post(&full);
+	}
+	return NULL;
+}
+
+void *sem_consumer(void *arg)
+{
+	int i = 0;
+	for (i = 0; i < MESSAGES; i++)
+	{
+		sem_wait(&full);
+		sem_wait(&mutex);
+		sum += ring[out];
+		out = (out + 1) % BUFFER;
+		sem_post(&mutex);
+		sem_post(&empty);
+	}
+	return NULL;
+}
+
+void *chan_producer(void *arg)
+{
+	chan *c = arg;
+	int i = 0;
+	for (i = 0; i < MESSAGES; i++)
+		chan_send(c, &i);
+	chan_close(c);
+	return NULL;
+}
+
+void *chan_consumer(void *arg)
+{
+	int item;
+	while (chan_recv(ch, &item) == 0)
+		sum += item;
+	return NULL;
+}
+
+void *select_consumer(void *arg)
+{
+	int a, b, open = 2;
+	chan_case cases[2] = {{ch, 0, &a, 0}, {ch2, 0, &b, 0}};
+	while (open > 0)
+	{
+		int i = chan_select(cases, open, 1);
+		if (!cases[i].ok)
+		{
+			// Drop the closed channel from the set
+			cases[i] = cases[--open];
+			continue;
+		}
+		sum += *(int *)cases[i].elem;
+	}
+	return NULL;
+}
+
+void report(const char *name, unsigned long long start, long messages)
+{
+	double secs = (now_ns() - start) / 1e9;
+	printf("%-12s %8.2f M msgs/s  (sum %ld)\n", name, messages / secs / 1e6, sum);
+	sum = 0;
+}
+
+void run_chan(const char *name, unsigned cap)
+{
+	pthread_t p, c;
+	ch = chan_make(cap, sizeof(int));
+	unsigned long long start = now_ns();
+	pthread_create(&c, NULL, chan_consumer, NULL);
+	pthread_create(&p, NULL, chan_producer, ch);
+	pthread_join(p, NULL);
+	pthread_join(c, NULL);
+	report(name, start, MESSAGES);
+	chan_destroy(ch);
+}
+
+int main()
+{
+	pthread_t p, c, p2;
+
+	sem_init(&empty, 0, BUFFER);
+	sem_init(&full, 0, 0);
+	sem_init(&mutex, 0, 1);
+	unsigned long long start = now_ns();
+	pthread_create(&c, NULL, sem_consumer, NULL);
+	pthread_create(&p, NULL, sem_producer, NULL);
+	pthread_join(p, NULL);
+	pthread_join(c, NULL);
+	report("semaphores", start, MESSAGES);
+
+	run_chan("chan cap 10", BUFFER);
+	run_chan("chan cap 0", 0);
+
+	ch = chan_make(BUFFER, sizeof(int));
+	ch2 = chan_make(BUFFER, sizeof(int));
+	start = now_ns();
+	pthread_create(&c, NULL, select_consumer, NULL);
+	pthread_create(&p, NULL, chan_producer, ch);
+	pthread_create(&p2, NULL, chan_producer, ch2);
+	pthread_join(p, NULL);
+	pthread_join(p2, NULL);
+	pthread_join(c, NULL);
+	report("chan select", start, 2L * MESSAGES);
+	chan_destroy(ch);
+	chan_destroy(ch2);
+	return 0;
+}
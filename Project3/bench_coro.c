@@ -0,0 +1,73 @@
+#include "threads.h"
+#include <stdio.h>
+#include <time.h>
+
+/*
+	Cost of a resume/yield round trip against a sem_post/sem_wait ping-pong between two threads
+	The coroutine is a generator counting up, the threads pass a counter back and forth
+*/
+
+#define ROUND_TRIPS 1000000
+
+sem_t ping, pong;
+long counter = 0;
+
+unsigned long long now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void *generator(void *arg)
+{
+	long i = 0;
+	for (i = 0; i < ROUND_TRIPS; i++)
+		coro_yield((void *)i);
+	return NULL;
+}
+
+void *sem_player(void *arg)
+{
+	int i = 0;
+	for (i = 0; i < ROUND_TRIPS; i++)
+	{
+		sem_wait(&ping);
+		counter++;
+		sem_post(&pong);
+	}
+	return NULL;
+}
+
+int main()
+{
+	coro *co = coro_create(generator, NULL);
+	long sum = 0;
+	unsigned long long start = now_ns();
+	while (1)
+	{
+		long v = (long)coro_resume(co, NULL);
+		if (coro_done(co))
+			break;
+		sum += v;
+	}
+	unsigned long long coro_ns = now_ns() - start;
+	coro_destroy(co);
+	printf("coroutine resume/yield  %7.1f ns per round trip  (sum %ld)\n", (double)coro_ns / ROUND_TRIPS, sum);
+
+	pthread_t t;
+	sem_init(&ping, 0, 0);
+	sem_init(&pong, 0, 0);
+	pthread_create(&t, NULL, sem_player, NULL);
+	start = now_ns();
+	int i = 0;
+	for (i = 0; i < ROUND_TRIPS; i++)
+	{
+		sem_post(&ping);
+		sem_wait(&pong);
+	}
+	unsigned long long sem_ns = now_ns() - start;
+	pthread_join(t, NULL);
+	printf("semaphore ping-pong     %7.1f ns per round trip  (count %ld)\n", (double)sem_ns / ROUND_TRIPS, counter);
+	return 0;
+}
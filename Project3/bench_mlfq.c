@@ -0,0 +1,148 @@
+#include "threads.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/*
+	Wakeup latency of IO-like threads next to CPU-bound ones, under round robin and MLFQ
+	A device thread completes a request for every IO thread each period,
+	the IO threads record how long it took them to get the CPU after the completion
+	The device sleeps between completions and the period is long enough for it to keep up under round robin
+	too (where it waits behind the CPU threads), so both policies see the same load
+	Completions per second are printed next to the percentiles to check that
+*/
+
+#define NUM_CPU 4
+#define NUM_IO 4
+#define RUN_MS 1000
+#define PERIOD_US 10000
+#define MAX_SAMPLES 4096
+
+sem_t done[NUM_IO];
+volatile unsigned long long posted_at[NUM_IO];
+volatile int stop = 0;
+long completions = 0;
+double run_secs = 0;
+unsigned long long samples[NUM_IO][MAX_SAMPLES];
+int nsamples[NUM_IO];
+
+unsigned long long now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void *cpu_thread(void *arg)
+{
+	volatile unsigned long spin = 0;
+	while (!stop)
+		spin++;
+	return NULL;
+}
+
+void *io_thread(void *arg)
+{
+	long id = (long)arg;
+	while (1)
+	{
+		sem_wait(&done[id]);
+		if (stop)
+			break;
+		if (nsamples[id] < MAX_SAMPLES)
+			samples[id][nsamples[id]++] = now_ns() - posted_at[id];
+		posted_at[id] = 0;
+	}
+	return NULL;
+}
+
+void *device_thread(void *arg)
+{
+	unsigned long long start = now_ns();
+	unsigned long long next = start;
+	while (now_ns() - start < RUN_MS * 1000000ULL)
+	{
+		// Block until the next completion is due instead of spinning, or MLFQ demotes us with the CPU threads
+		unsigned long long now = now_ns();
+		if (now < next)
+		{
+			green_sleep((next - now + 999) / 1000);
+			continue;
+		}
+		next += PERIOD_US * 1000ULL;
+
+		// Complete a request for every IO thread that is done with its last one
+		int i = 0;
+		for (i = 0; i < NUM_IO; i++)
+		{
+			if (posted_at[i] == 0)
+			{
+				posted_at[i] = now_ns();
+				completions++;
+				sem_post(&done[i]);
+			}
+		}
+	}
+
+	run_secs = (now_ns() - start) / 1e9;
+	stop = 1;
+	int i = 0;
+	for (i = 0; i < NUM_IO; i++)
+		sem_post(&done[i]);
+	return NULL;
+}
+
+int compare(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+	return (x > y) - (x < y);
+}
+
+void run(const char *name, enum greenPolicy policy)
+{
+	static unsigned long long all[NUM_IO * MAX_SAMPLES];
+	pthread_t cpu[NUM_CPU], io[NUM_IO], device;
+	int i = 0, n = 0;
+
+	green_set_policy(policy);
+	stop = 0;
+	completions = 0;
+	for (i = 0; i < NUM_IO; i++)
+	{
+		sem_init(&done[i], 0, 0);
+		posted_at[i] = 0;
+		nsamples[i] = 0;
+		pthread_create(&io[i], NULL, io_thread, (void *)(long)i);
+	}
+	for (i = 0; i < NUM_CPU; i++)
+		pthread_create(&cpu[i], NULL, cpu_thread, NULL);
+	pthread_create(&device, NULL, device_thread, NULL);
+
+	pthread_join(device, NULL);
+	for (i = 0; i < NUM_CPU; i++)
+		pthread_join(cpu[i], NULL);
+	for (i = 0; i < NUM_IO; i++)
+	{
+		pthread_join(io[i], NULL);
+		memcpy(all + n, samples[i], nsamples[i] * sizeof(all[0]));
+		n += nsamples[i];
+		sem_destroy(&done[i]);
+	}
+
+	qsort(all, n, sizeof(all[0]), compare);
+	if (n == 0)
+	{
+		printf("%-5s no samples\n", name);
+		return;
+	}
+	printf("%-5s completions %6.0f/s  wakeups %5d  p50 %8.1f us  p99 %8.1f us  max %8.1f us\n", name,
+		   completions / run_secs, n, all[n / 2] / 1000.0, all[n * 99 / 100] / 1000.0, all[n - 1] / 1000.0);
+}
+
+int main()
+{
+	green_set_quantum(1000);
+	run("rr", GREEN_SCHED_RR);
+	run("mlfq", GREEN_SCHED_MLFQ);
+	return 0;
+}
@@ -0,0 +1,66 @@
+#include "threads.h"
+#include <stdio.h>
+#include <time.h>
+
+/*
+	Short jobs per second on a thread pool against creating and joining a thread per job
+	Each job adds its argument to a total, so only the scheduling overhead is measured
+*/
+
+#define JOBS 200000
+#define WORKERS 8
+#define BATCH 1000
+
+long total = 0;
+
+unsigned long long now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void job(void *arg)
+{
+	total += (long)arg;
+}
+
+void *thread_job(void *arg)
+{
+	job(arg);
+	return NULL;
+}
+
+void report(const char *name, unsigned long long start)
+{
+	double secs = (now_ns() - start) / 1e9;
+	printf("%-16s %8.2f M jobs/s  (total %ld)\n", name, JOBS / secs / 1e6, total);
+	total = 0;
+}
+
+int main()
+{
+	static pthread_t t[BATCH];
+	long i = 0;
+	int j = 0;
+
+	// Spawn in batches to stay under the thread limit
+	unsigned long long start = now_ns();
+	for (i = 0; i < JOBS; i += BATCH)
+	{
+		for (j = 0; j < BATCH; j++)
+			pthread_create(&t[j], NULL, thread_job, (void *)1);
+		for (j = 0; j < BATCH; j++)
+			pthread_join(t[j], NULL);
+	}
+	report("spawn per job", start);
+
+	start = now_ns();
+	pool *p = pool_create(WORKERS);
+	for (i = 0; i < JOBS; i++)
+		pool_submit(p, job, (void *)1);
+	pool_wait(p);
+	pool_destroy(p);
+	report("pool", start);
+	return 0;
+}
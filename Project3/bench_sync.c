@@ -0,0 +1,153 @@
+#ifdef NPTL
+#include <pthread.h>
+#include <semaphore.h>
+#else
+#include "threads.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/*
+	Native mutex and condition variable against the same things built from semaphores
+	Build it with threads.o for the green library, or with -DNPTL to compare with kernel threads
+*/
+
+#define UNCONTENDED 10000000
+#define NUM_WORKERS 4
+#define INCREMENTS 1000000
+#define ROUND_TRIPS 100000
+
+pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+sem_t sem_mutex;
+sem_t ping, pong;
+long counter = 0;
+int turn = 0;
+
+unsigned long long now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void *mutex_worker(void *arg)
+{
+	int i = 0;
+	for (i = 0; i < INCREMENTS; i++)
+	{
+		pthread_mutex_lock(&mutex);
+		counter++;
+		pthread_mutex_unlock(&mutex);
+	}
+	return NULL;
+}
+
+void *sem_worker(void *arg)
+{
+	int i = 0;
+	for (i = 0; i < INCREMENTS; i++)
+	{
+		sem_wait(&sem_mutex);
+		counter++;
+		sem_post(&sem_mutex);
+	}
+	return NULL;
+}
+
+// Two threads take turns, once with a condition variable and once with a pair of semaphores
+void *cond_player(void *arg)
+{
+	long me = (long)arg;
+	int i = 0;
+	for (i = 0; i < ROUND_TRIPS; i++)
+	{
+		pthread_mutex_lock(&mutex);
+		while (turn != me)
+			pthread_cond_wait(&cond, &mutex);
+		turn = !me;
+		pthread_cond_broadcast(&cond);
+		pthread_mutex_unlock(&mutex);
+	}
+	return NULL;
+}
+
+void *sem_player(void *arg)
+{
+	long me = (long)arg;
+	int i = 0;
+	for (i = 0; i < ROUND_TRIPS; i++)
+	{
+		sem_wait(me ? &pong : &ping);
+		sem_post(me ? &ping : &pong);
+	}
+	return NULL;
+}
+
+void contended(const char *name, void *(*worker)(void *))
+{
+	pthread_t workers[NUM_WORKERS];
+	int i = 0;
+
+	counter = 0;
+	unsigned long long start = now_ns();
+	for (i = 0; i < NUM_WORKERS; i++)
+		pthread_create(&workers[i], NULL, worker, NULL);
+	for (i = 0; i < NUM_WORKERS; i++)
+		pthread_join(workers[i], NULL);
+	unsigned long long elapsed = now_ns() - start;
+
+	printf("%-28s %8.1f ns/op  (counter %ld)\n", name, (double)elapsed / (NUM_WORKERS * INCREMENTS), counter);
+}
+
+void pingpong(const char *name, void *(*player)(void *))
+{
+	pthread_t players[2];
+
+	turn = 0;
+	unsigned long long start = now_ns();
+	pthread_create(&players[0], NULL, player, (void *)0L);
+	pthread_create(&players[1], NULL, player, (void *)1L);
+	pthread_join(players[0], NULL);
+	pthread_join(players[1], NULL);
+	unsigned long long elapsed = now_ns() - start;
+
+	printf("%-28s %8.1f ns/round trip\n", name, (double)elapsed / ROUND_TRIPS);
+}
+
+int main()
+{
+	int i = 0;
+	unsigned long long start;
+
+	sem_init(&sem_mutex, 0, 1);
+	sem_init(&ping, 0, 1);
+	sem_init(&pong, 0, 0);
+
+	start = now_ns();
+	for (i = 0; i < UNCONTENDED; i++)
+	{
+		pthread_mutex_lock(&mutex);
+		pthread_mutex_unlock(&mutex);
+	}
+	printf("%-28s %8.1f ns/op\n", "mutex uncontended", (double)(now_ns() - start) / UNCONTENDED);
+
+	start = now_ns();
+	for (i = 0; i < UNCONTENDED; i++)
+	{
+		sem_wait(&sem_mutex);
+		sem_post(&sem_mutex);
+	}
+	printf("%-28s %8.1f ns/op\n", "sem as mutex uncontended", (double)(now_ns() - start) / UNCONTENDED);
+
+	contended("mutex 4 threads", mutex_worker);
+	contended("sem as mutex 4 threads", sem_worker);
+	pingpong("cond ping-pong", cond_player);
+	pingpong("sem ping-pong", sem_player);
+
+	sem_destroy(&sem_mutex);
+	sem_destroy(&ping);
+	sem_destroy(&pong);
+	return 0;
+}
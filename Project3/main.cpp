@@ -2,7 +2,7 @@
 #include <stdio.h>
 #include <string.h>
 
-#define NUM_THREADS 5
+#define NUM_THREADS 1000
 
 /*
 	Copied from sample program
@@ -14,10 +14,12 @@ sem_t mutex;
 int in = 0;
 int out = 0;
 int buffer[10];
+long produced = 0;
+long consumed = 0;
 
 void producer()
 {
-	printf("producer starting for thread %d\n", (unsigned int)pthread_self());
+	//printf("producer starting for thread %d\n", (unsigned int)pthread_self());
 	int item;
 	int i = 0;
 	while (i < 10)
@@ -28,7 +30,8 @@ void producer()
 		//printf("decrementing mutex in prod: %d\n", (unsigned int)pthread_self());
 		sem_wait(&mutex);
 		buffer[in] = item;
-		printf("producer %d: inserted %d in index %d\n", (unsigned int)pthread_self(), item, in);
+		//printf("producer %d: inserted %d in index %d\n", (unsigned int)pthread_self(), item, in);
+		produced += item;
 		in = (in + 1) % 10;
 		//printf("incrementing mutex in prod: %d\n", (unsigned int)pthread_self());
 		sem_post(&mutex);
@@ -40,7 +43,7 @@ void producer()
 
 void consumer()
 {
-	printf("consumer starting for thread %d\n", (unsigned int)pthread_self());
+	//printf("consumer starting for thread %d\n", (unsigned int)pthread_self());
 	int item;
 	int i = 0;
 	while (i < 10)
@@ -51,7 +54,8 @@ void consumer()
 		//printf("decrementing mutex in consumer: %d\n", (unsigned int)pthread_self());
 		sem_wait(&mutex);
 		item = buffer[out];
-		printf("consumer %d: removed %d in index %d\n", (unsigned int)pthread_self(), item, out);
+		//printf("consumer %d: removed %d in index %d\n", (unsigned int)pthread_self(), item, out);
+		consumed += item;
 		out = (out + 1) % 10;
 		//printf("incrementing mutex in consumer: %d\n", (unsigned int)pthread_self());
 		sem_post(&mutex);
@@ -72,16 +76,14 @@ int main()
 	int i = 0;
 	for (i = 0; i < NUM_THREADS; i++)
 	{
-		printf("making producer thread %d\n", i);
+		//printf("making producer thread %d\n", i);
 		pthread_create(&producers[i], NULL, (void *)producer, NULL);
-		i++;
 	}
 	i = 0;
 	for (i = 0; i < NUM_THREADS; i++)
 	{
-		printf("making consumer thread %d\n", i);
+		//printf("making consumer thread %d\n", i);
 		pthread_create(&consumers[i], NULL, (void *)consumer, NULL);
-		i++;
 	}
 
 	i = 0;
@@ -89,15 +91,15 @@ int main()
 	for (i = 0; i < NUM_THREADS; i++)
 	{
 		pthread_join(producers[i], NULL);
-		i++;
 	}
 	i = 0;
 	for (i = 0; i < NUM_THREADS; i++)
 	{
 		pthread_join(consumers[i], NULL);
-		i++;
 	}
 
+	// Every item should come out exactly once, so the sums have to match
+	printf("%d producers inserted items summing to %ld, %d consumers removed %ld\n", NUM_THREADS, produced, NUM_THREADS, consumed);
 	printf("destroying semaphores\n");
 	sem_destroy(&mutex);
 	sem_destroy(&empty);
@@ -1,13 +1,67 @@
 #define _XOPEN_SOURCE 700
-#define _BSD_SOURCE
+#define _DEFAULT_SOURCE
 
 #include "threads.h"
 #include "ec440threads.h"
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/select.h>
+#include <sys/mman.h>
+#include <x86intrin.h>
+#include <execinfo.h>
+#include <ucontext.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
-// Maximum number of threads running at a time
-#define MAX_THREADS 128
+// Maximum number of threads running at a time, can be raised with -DMAX_THREADS=n
+#ifndef MAX_THREADS
+#define MAX_THREADS 4096
+#endif
 // Size of the stack allocated per thread
 #define STACK_SIZE 32767
+// Byte painted over new stacks to find their high-water mark, and the word guarding their bottom
+#define STACK_PAINT 0xa5
+#define STACK_CANARY 0x5ca1ab1edeadbeefUL
+// High-water histogram in KiB buckets
+#define STACK_BUCKETS (STACK_SIZE / 1024 + 1)
+// Default time slice and the smallest one we accept, in microseconds
+#define DEFAULT_QUANTUM_US 50000
+#define MIN_QUANTUM_US 100
+// Number of MLFQ priority levels, a thread at level L gets 2^L ticks before it is demoted
+#define MLFQ_LEVELS 4
+// Every MLFQ_BOOST_TICKS ticks all unpinned threads go back to the top level
+#define MLFQ_BOOST_TICKS 100
+// Weight of a thread under the fair policy unless green_set_weight says otherwise
+#define DEFAULT_WEIGHT 1024
+// End of a run queue
+#define NO_THREAD ((pthread_t)-1)
+// Buckets in the green_wait address table
+#define WAIT_BUCKETS 256
+// Highest file descriptor green_read/green_write/green_accept can park on, plus one
+#define MAX_FDS 65536
+// Events fetched per epoll_wait
+#define IO_EVENTS 64
+// Timer wheel for sleeps and timeouts: slots of WHEEL_RES_NS, one lap covers WHEEL_SLOTS of them
+#define WHEEL_SLOTS 256
+#define WHEEL_RES_NS 1000000ULL
+// Task deques that can be handed out, and the workers started by the first task_spawn
+#define TASK_DEQUES 64
+#define TASK_WORKERS 4
+// Trace ring buffer, the oldest events are overwritten once it wraps
+#define TRACE_EVENTS (1 << 20)
+// Profiler samples kept, and frames walked per sample
+#define PROF_SAMPLES 65536
+#define PROF_DEPTH 32
+// Times pthread_exit goes over the keys while destructors keep setting values (PTHREAD_DESTRUCTOR_ITERATIONS)
+#define KEY_DESTRUCTOR_ROUNDS 4
+// First word of a process-shared sem_t, odd so it can never be a seminfo pointer
+#define PSHARED_SEM_TAG 0x7073656d70736801UL
+// Longest a process-shared sem_wait sleeps in the kernel while timers or I/O are waiting on us
+#define PSHARED_SLEEP_NS 1000000LL
+// Runtime calls a thread gets in deterministic mode before it is preempted, unless GREEN_CHECKPOINTS says otherwise
+#define DET_CHECKPOINTS 16
 
 // Array index definitions for __jmp_buf
 #define JB_RBX 0
@@ -19,6 +73,11 @@
 #define JB_RSP 6
 #define JB_PC 7
 
+// Registers in the ucontext handed to SA_SIGINFO handlers (REG_RBP and REG_RIP need _GNU_SOURCE)
+#define GREG_RBP 10
+#define GREG_RSP 15
+#define GREG_RIP 16
+
 // Each of these should be active for all calls to this file
 // Signal handler for SIGALRM
 static struct sigaction alrm_handler;
@@ -26,391 +85,3620 @@ static struct sigaction alrm_handler;
 static pthread_t curr_TID = 0;
 // Keep track of all the created threads
 static thread TCB[MAX_THREADS];
+// The running thread's TCB, for the inline green_getspecific
+thread *green_self = &TCB[0];
+// Thread-specific data keys in use and their destructors
+static int key_used[GREEN_KEYS];
+static void (*key_dtor[GREEN_KEYS])(void *);
 // Keep track of the total number of threads
 static int total_threads = 0;
 // Do something special in the first call
 static int first_call = 1;
+// Unused TCB slots, lowest ID on top, so pthread_create does not have to scan for one
+static pthread_t free_slots[MAX_THREADS];
+static int free_count = 0;
+// A detached thread that just exited, its stack is freed by the next thread to run
+static pthread_t reap_tid = NO_THREAD;
+// Preemption timer, fires SIGALRM every quantum_us while it is armed
+static timer_t tick_timer;
+static unsigned long quantum_us = DEFAULT_QUANTUM_US;
+static int tick_armed = 0;
+// Cleared for cooperative scheduling: no tick, and lock()/unlock() leave the signal mask alone
+static int preempt = 1;
+// Deterministic mode: the next thread comes from a seeded PRNG and a thread is preempted after
+// det_checkpoints calls into the runtime instead of by the timer
+static int deterministic = 0;
+static unsigned long long det_state = 0;
+static long det_checkpoints = DET_CHECKPOINTS;
+static long det_left = DET_CHECKPOINTS;
+// Scheduler counters for green_stats_dump, preempting tells scheduler() it was called from the tick
+static unsigned long long stat_ticks = 0;
+static unsigned long long stat_switches = 0;
+static int preempting = 0;
+// Stack painting for high-water marks, and the histogram of marks of threads that exited
+static int stack_paint = 0;
+static unsigned long stack_hist[STACK_BUCKETS];
+static long page_size = 0;
 
-void scheduler()
+// Scheduler events recorded while tracing, written out as Chrome trace_event JSON
+enum traceType
 {
-    // Find the next thread that is ready, avoid an infinite loop if there are no more READY threads
-    pthread_t next = curr_TID + 1;
-    while (TCB[next].status != READY && next != curr_TID)
-        next = (next + 1) % MAX_THREADS;
+    TRACE_SWITCH_IN,
+    TRACE_SWITCH_OUT,
+    TRACE_CREATE,
+    TRACE_EXIT,
+    TRACE_JOIN,
+    TRACE_SEM_WAIT,
+    TRACE_SEM_POST,
+    TRACE_BLOCK,
+    TRACE_WAKE
+};
 
-    int jumped = 0;
+typedef struct
+{
+    unsigned long long tsc;
+    unsigned long long arg;
+    int tid;
+    int type;
+} traceEvent;
 
-    // Change the status of the currently running thread to READY and save the state
-    if (TCB[curr_TID].status == RUNNING)
-    {
-        TCB[curr_TID].status = READY;
-        jumped = setjmp(TCB[curr_TID].reg);
-    }
+// Names of enum Status for the stats and the trace
+static const char *status_names[] = {"ready", "running", "exited", "waiting", "fresh", "blocked", "sleeping"};
 
-    // setjmp returns 0 if returning directly, and nonzero when returning from longjmp
-    // if we're just returning from a longjmp, don't longjmp again
-    if (!jumped)
-    {
-        // Update the current running thread
-        curr_TID = next;
-        TCB[curr_TID].status = RUNNING;
+static int trace_on = 0;
+static traceEvent *trace_buf = NULL;
+static unsigned long trace_next = 0;
+static char *trace_path = NULL;
+static unsigned long long trace_tsc0, trace_ns0;
 
-        // Return 1 to the setjmp that its calling back to
-        longjmp(TCB[next].reg, 1);
-    }
+// A predictable branch when tracing is off, the arguments are not even evaluated
+#define TRACE(type, tid, arg)                                           \
+    do                                                                  \
+    {                                                                   \
+        if (__builtin_expect(trace_on, 0))                              \
+            trace_record((type), (tid), (unsigned long long)(arg));     \
+    } while (0)
+
+// Stacks sampled by the profiler on every tick, innermost frame first
+typedef struct
+{
+    int tid;
+    int depth;
+    void *pc[PROF_DEPTH];
+} profSample;
+
+static int prof_on = 0;
+static profSample *prof_buf = NULL;
+static int prof_len = 0;
+static unsigned long prof_dropped = 0;
+static char *prof_path = NULL;
+// Top of the main thread's stack, glibc exports it
+extern void *__libc_stack_end;
+
+// Claim a slot without locking, safe from the tick handler too
+static void trace_record(int type, pthread_t tid, unsigned long long arg)
+{
+    unsigned long slot = __atomic_fetch_add(&trace_next, 1, __ATOMIC_RELAXED) % TRACE_EVENTS;
+    trace_buf[slot].tsc = __rdtsc();
+    trace_buf[slot].arg = arg;
+    trace_buf[slot].tid = (int)tid;
+    trace_buf[slot].type = type;
 }
+// Scheduling policy and the READY threads, one FIFO per level (round robin only uses level 0)
+static enum greenPolicy policy = GREEN_SCHED_RR;
+static pthread_t rq_head[MLFQ_LEVELS];
+static pthread_t rq_tail[MLFQ_LEVELS];
+static int rq_len = 0;
+// Min-heap of READY threads, on virtual runtime for the fair policy or on absolute deadline for EDF
+typedef struct
+{
+    pthread_t item[MAX_THREADS];
+    int len;
+    int by_deadline;
+} heap;
+// The fair policy keeps READY threads in a heap instead of the levels
+static heap fair_heap = {.by_deadline = 0};
+// EDF threads are kept apart and always run before the policy's threads
+static heap edf_heap = {.by_deadline = 1};
+// Number of EDF threads and their summed density budget/deadline, in parts per million
+static int edf_count = 0;
+static unsigned long edf_density = 0;
+// Never decreases, new and woken threads start from here so they cannot hog the CPU
+static unsigned long long min_vruntime = 0;
+// Ticks since the last MLFQ priority reset
+static int boost_ticks = 0;
+// Thread a semaphore with direct handoff just woke, the scheduler runs it next
+static pthread_t handoff_to = NO_THREAD;
+// Threads parked in green_wait, hashed on the address they wait on
+static waitqueue wait_table[WAIT_BUCKETS];
+// Threads parked on file descriptors, allocated per fd on first use, and the epoll instance watching them
+static iowait *io_table[MAX_FDS];
+static int epoll_fd = -1;
+static int io_waiters = 0;
+// Sleeping and timed-out-waiting threads, hashed by expiry tick into the wheel slots
+static pthread_t wheel[WHEEL_SLOTS];
+static unsigned long long wheel_tick = 0;
+static int timers_pending = 0;
+// Signals routed to green_sigwait, the handler only flags them and the scheduler wakes the waiters
+static sigset_t sig_watched;
+static volatile sig_atomic_t sig_caught[NSIG];
+static volatile sig_atomic_t sig_new = 0;
+static waitqueue sig_waiting;
+static int sig_waiters = 0;
+// Fork-join tasks: one deque per worker (or any thread that spawns), handed out in order
+static taskdeque *task_deques[TASK_DEQUES];
+static int task_ndeques = 0;
+// Deques of threads that exited, reused before a new one is made (index + 1, like TCB task_deque)
+static int task_free_deques[TASK_DEQUES];
+static int task_nfree = 0;
+static pthread_t task_workers[TASK_DEQUES];
+static int task_nworkers = 0;
+static int task_idle = 0;
+static int task_stopping = 0;
+static waitqueue task_idlers;
 
-void init_system()
+static void tick_arm()
 {
-    // initialize all TCB states to FRESH and set their id to their array index on first call
-    pthread_t i = 0;
-    while (i < MAX_THREADS)
-    {
-        TCB[i].status = FRESH;
-        TCB[i].id = i;
-        TCB[i].joining = -1;
-        i++;
-    }
+    if (tick_armed || first_call || !preempt)
+        return;
 
-    // send a SIGALRM after 50ms and then every 50ms after that (__useconds_t stores MICROseconds)
-    __useconds_t cooldown = (50 * 1000);
-    ualarm(cooldown, cooldown);
+    struct itimerspec spec;
+    spec.it_value.tv_sec = quantum_us / 1000000;
+    spec.it_value.tv_nsec = (quantum_us % 1000000) * 1000;
+    spec.it_interval = spec.it_value;
+    timer_settime(tick_timer, 0, &spec, NULL);
+    tick_armed = 1;
+}
 
-    // SIGALARM handler
-    // When the alarm handler is triggered, call scheduler
-    alrm_handler.sa_handler = &scheduler;
-    // SA_NODEFER: Do not add the signal to the thread's signal mask while the handler is executing
-    alrm_handler.sa_flags = SA_NODEFER;
-    // When SIGALRM is caught, trigger the alarm handler
-    sigaction(SIGALRM, &alrm_handler, NULL);
+static void tick_disarm()
+{
+    if (!tick_armed)
+        return;
+
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    timer_settime(tick_timer, 0, &spec, NULL);
+    tick_armed = 0;
 }
 
-int pthread_create(
-    pthread_t *thread,
-    const pthread_attr_t *attr,
-    void *(*start_routine)(void *),
-    void *arg)
+// Monotonic clock in nanoseconds
+static unsigned long long now_ns()
 {
-    lock();
-    // On the first call initialize the TCB and SIGALRM, and hold onto the main thread
-    int main_thread = 0;
-    if (first_call)
-    {
-        // printf("initializing system\n");
-        init_system();
-        first_call = 0;
-        TCB[0].status = RUNNING;
-        total_threads++;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-        // Main thread jumps here
-        main_thread = setjmp(TCB[0].reg);
-    }
+// Append a thread to the back of its run queue level
+static void fifo_push(pthread_t tid)
+{
+    int lvl = (policy == GREEN_SCHED_MLFQ) ? TCB[tid].level : 0;
 
-    // When main_thread jumps back, long_jmp will set it to 1
-    if (!main_thread)
-    {
-        // If there are already a MAX amount of threads, return
-        if (total_threads > MAX_THREADS)
-        {
-            printf("Error: Maximum Thread amount reached\n");
-            return -1;
-        }
+    TCB[tid].rq_level = lvl;
+    TCB[tid].rq_next = NO_THREAD;
+    TCB[tid].rq_prev = rq_tail[lvl];
+    if (rq_head[lvl] == NO_THREAD)
+        rq_head[lvl] = tid;
+    else
+        TCB[rq_tail[lvl]].rq_next = tid;
+    rq_tail[lvl] = tid;
+    rq_len++;
+}
 
-        // Check for the closest FRESH thread without going out of bounds
-        pthread_t i = 0;
-        while (i < MAX_THREADS && TCB[i].status != FRESH)
-        {
-            i++;
-        }
-        // set first jump
-        setjmp(TCB[i].reg);
+// Unlink a READY thread from its level in O(1)
+static void fifo_remove(pthread_t tid)
+{
+    int lvl = TCB[tid].rq_level;
 
-        // Set input thread to the id of TCB
-        *thread = i;
-        // jmpbug stores long int types, addresses are unsigned
-        // Set args (could be signed or unsigned) to R13 in jmpbuf
-        TCB[i].reg->__jmpbuf[JB_R13] = (long int)arg;
-        // Set start_routine to R12 in jmpbuf
-        TCB[i].reg->__jmpbuf[JB_R12] = (unsigned long int)start_routine;
-        // Set the program counter (RIP) to start_thunk
-        TCB[i].reg->__jmpbuf[JB_PC] = ptr_mangle((unsigned long int)start_thunk);
+    if (TCB[tid].rq_prev == NO_THREAD)
+        rq_head[lvl] = TCB[tid].rq_next;
+    else
+        TCB[TCB[tid].rq_prev].rq_next = TCB[tid].rq_next;
+    if (TCB[tid].rq_next == NO_THREAD)
+        rq_tail[lvl] = TCB[tid].rq_prev;
+    else
+        TCB[TCB[tid].rq_next].rq_prev = TCB[tid].rq_prev;
+    rq_len--;
+}
 
-        /*
-            Before we set the stack pointer in the RSP register, we need to put
-            pthread_exit at the beginning of the stack, so a thread automatically
-            exits at the end of its runtime
-        */
+// Take the first thread off the highest non-empty level, NO_THREAD if nothing is READY
+static pthread_t fifo_pop()
+{
+    int lvl = 0;
+    while (lvl < MLFQ_LEVELS && rq_head[lvl] == NO_THREAD)
+        lvl++;
+    if (lvl == MLFQ_LEVELS)
+        return NO_THREAD;
 
-        // Allocate the stack
-        TCB[i].stack = malloc(STACK_SIZE);
+    pthread_t tid = rq_head[lvl];
+    fifo_remove(tid);
+    return tid;
+}
 
-        // The "top" of the stack starts at 32767
-        // Allocate enough space for the pthread_exit function, function address is 8bytes long
-        void *topspace = (TCB[i].stack + STACK_SIZE) - 8;
-        void *exit_addr = (void *)&pthread_exit_wrapper;
+static unsigned long long heap_key(heap *h, pthread_t tid)
+{
+    return h->by_deadline ? TCB[tid].edf_abs_deadline : TCB[tid].vruntime;
+}
 
-        // Copy the address into the stack
-        memcpy(topspace, &exit_addr, 8);
+static int heap_less(heap *h, int a, int b)
+{
+    return heap_key(h, h->item[a]) < heap_key(h, h->item[b]);
+}
 
-        // Set the stack pointer (RSP) to the start of the stack after the address of pthread_exit
-        TCB[i].reg->__jmpbuf[JB_RSP] = ptr_mangle((unsigned long int)topspace);
+static void heap_swap(heap *h, int a, int b)
+{
+    pthread_t tmp = h->item[a];
+    h->item[a] = h->item[b];
+    h->item[b] = tmp;
+    TCB[h->item[a]].heap_idx = a;
+    TCB[h->item[b]].heap_idx = b;
+}
 
-        // After the thread is setup, it is ready to run
-        TCB[i].status = READY;
-        total_threads++;
+static void heap_sift_up(heap *h, int i)
+{
+    while (i > 0 && heap_less(h, i, (i - 1) / 2))
+    {
+        heap_swap(h, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
 
-        // Optional: Choose whether or not to run the scheduler after a new thread is created
-        // scheduler();
+static void heap_sift_down(heap *h, int i)
+{
+    while (1)
+    {
+        int min = i;
+        if (2 * i + 1 < h->len && heap_less(h, 2 * i + 1, min))
+            min = 2 * i + 1;
+        if (2 * i + 2 < h->len && heap_less(h, 2 * i + 2, min))
+            min = 2 * i + 2;
+        if (min == i)
+            return;
+        heap_swap(h, i, min);
+        i = min;
     }
-    // On main thread, main is stalling and waiting for the rest of the threads to finish
+}
 
-    unlock();
-    // On successful call, reach the end and return 0
-    return 0;
+static void heap_push(heap *h, pthread_t tid)
+{
+    h->item[h->len] = tid;
+    TCB[tid].heap_idx = h->len;
+    h->len++;
+    heap_sift_up(h, h->len - 1);
 }
 
-void pthread_exit(void *value_ptr)
+static void heap_remove(heap *h, pthread_t tid)
 {
-    lock();
-    // Change the status of the thread to waiting to be joined
-    //("pthread_exit called on thread %d\n", (int)curr_TID);
-    TCB[curr_TID].status = WAITING;
+    int i = TCB[tid].heap_idx;
+    h->len--;
+    if (i != h->len)
+    {
+        h->item[i] = h->item[h->len];
+        TCB[h->item[i]].heap_idx = i;
+        heap_sift_up(h, i);
+        heap_sift_down(h, TCB[h->item[i]].heap_idx);
+    }
+}
 
-    int joined;
+// Smallest key first, O(log n)
+static pthread_t heap_pop(heap *h)
+{
+    if (h->len == 0)
+        return NO_THREAD;
+    pthread_t tid = h->item[0];
+    heap_remove(h, tid);
+    return tid;
+}
 
-    if (TCB[curr_TID].joining != -1)
-        // there is a thread waiting to join this thread
-        joined = TCB[curr_TID].joining + MAX_THREADS;
+// Run queue operations, EDF threads first and then the current policy
+static void rq_push(pthread_t tid)
+{
+    if (TCB[tid].edf)
+    {
+        heap_push(&edf_heap, tid);
+        rq_len++;
+    }
+    else if (policy == GREEN_SCHED_FAIR)
+    {
+        heap_push(&fair_heap, tid);
+        rq_len++;
+    }
     else
-        joined = (int)setjmp(TCB[curr_TID].reg);
+        fifo_push(tid);
+}
 
-    if (!joined)
-    {
-        // Check if there are any more threads left to schedule (except the main thread)
-        int i = 1;
-        while (i < MAX_THREADS && TCB[i].status != READY)
-            i++;
+static pthread_t rq_pop()
+{
+    pthread_t tid = heap_pop(&edf_heap);
+    if (tid == NO_THREAD && policy != GREEN_SCHED_FAIR)
+        return fifo_pop();
 
-        // if there are no ready threads, jump back to main to finish main thread
-        if (i == MAX_THREADS)
+    if (tid == NO_THREAD)
+        tid = heap_pop(&fair_heap);
+    if (tid != NO_THREAD)
+        rq_len--;
+    return tid;
+}
+
+static void rq_remove(pthread_t tid)
+{
+    if (!TCB[tid].edf && policy != GREEN_SCHED_FAIR)
+        return fifo_remove(tid);
+
+    heap_remove(TCB[tid].edf ? &edf_heap : &fair_heap, tid);
+    rq_len--;
+}
+
+// splitmix64, any seed (0 included) gives a full-period sequence
+static unsigned long long det_rand()
+{
+    unsigned long long z = (det_state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// Deterministic mode's rq_pop: any READY thread of the policy, chosen by the PRNG
+// EDF threads keep their deadline order
+static pthread_t det_pick()
+{
+    if (rq_len == 0 || edf_heap.len > 0)
+        return rq_pop();
+
+    unsigned long r = det_rand() % rq_len;
+    if (policy == GREEN_SCHED_FAIR)
+    {
+        // The heap layout follows vruntime, which is wall-clock time, so count the heap's threads in tid order
+        pthread_t tid = 0;
+        for (tid = 0; tid < MAX_THREADS; tid++)
         {
-            unlock();
-            curr_TID = 0;
-            longjmp(TCB[0].reg, 1);
+            int i = TCB[tid].heap_idx;
+            if (i < fair_heap.len && fair_heap.item[i] == tid && r-- == 0)
+            {
+                heap_remove(&fair_heap, tid);
+                rq_len--;
+                return tid;
+            }
         }
+        return rq_pop();
+    }
 
-        // Call scheduler if there are still threads ready to be scheduled
-        else
+    int lvl = 0;
+    for (lvl = 0; lvl < MLFQ_LEVELS; lvl++)
+    {
+        pthread_t tid = rq_head[lvl];
+        for (; tid != NO_THREAD; tid = TCB[tid].rq_next)
         {
-            unlock();
-            scheduler();
+            if (r-- == 0)
+            {
+                fifo_remove(tid);
+                return tid;
+            }
         }
     }
-    else if (joined)
+    return rq_pop();
+}
+
+// Re-queue every READY thread after levels or the policy changed, keeping their order
+// EDF threads do not depend on the policy and stay where they are
+static void rq_rebuild()
+{
+    // Chain all the levels and the heap together, highest first
+    pthread_t first = NO_THREAD, last = NO_THREAD;
+    int i = 0;
+    while (i < fair_heap.len)
+    {
+        if (first == NO_THREAD)
+            first = fair_heap.item[i];
+        else
+            TCB[last].rq_next = fair_heap.item[i];
+        last = fair_heap.item[i];
+        TCB[last].rq_next = NO_THREAD;
+        i++;
+    }
+    fair_heap.len = 0;
+
+    int lvl = 0;
+    while (lvl < MLFQ_LEVELS)
     {
-        // If the thread has been joined, free the stack and jump back to the joining thread
-        // printf("exiting thread %d after joined by thread %d\n", (int)curr_TID, joined);
-        if (TCB[curr_TID].status != EXITED)
+        if (rq_head[lvl] != NO_THREAD)
         {
-            TCB[curr_TID].status = EXITED;
-            // printf("freeing stack of thread %d\n", (int)curr_TID);
-            free(TCB[curr_TID].stack);
-            total_threads--;
+            if (first == NO_THREAD)
+                first = rq_head[lvl];
+            else
+                TCB[last].rq_next = rq_head[lvl];
+            last = rq_tail[lvl];
         }
-        // Copy the exit value of pthread_exit for pthread_join
-        TCB[curr_TID].exitcode = (void *)value_ptr;
-        // Remove offset
-        curr_TID = (pthread_t)(joined - MAX_THREADS);
+        rq_head[lvl] = NO_THREAD;
+        rq_tail[lvl] = NO_THREAD;
+        lvl++;
+    }
+    rq_len = edf_heap.len;
+    if (last != NO_THREAD)
+        TCB[last].rq_next = NO_THREAD;
 
-        // printf("jumping to thread %d\n", (int)curr_TID);
-        unlock();
-        longjmp(TCB[curr_TID].reg, 1);
+    while (first != NO_THREAD)
+    {
+        pthread_t next = TCB[first].rq_next;
+        rq_push(first);
+        first = next;
     }
-    // else in the main thread, exit 0
-    exit(0);
 }
 
-void pthread_exit_wrapper()
+// Charge the running thread for the CPU time since it was switched in
+static void account(pthread_t tid)
 {
-    unsigned long int res;
-    asm("movq %%rax, %0\n"
-        : "=r"(res));
-    pthread_exit((void *)res);
+    unsigned long long now = now_ns();
+    unsigned long long delta = now - TCB[tid].switched_in;
+    TCB[tid].switched_in = now;
+    TCB[tid].runtime += delta;
+    TCB[tid].vruntime += delta * DEFAULT_WEIGHT / TCB[tid].weight;
+    if (TCB[tid].edf)
+        TCB[tid].edf_used += delta;
+
+    // min_vruntime follows the smallest of the running thread and the heap
+    unsigned long long min = TCB[tid].vruntime;
+    if (fair_heap.len > 0 && TCB[fair_heap.item[0]].vruntime < min)
+        min = TCB[fair_heap.item[0]].vruntime;
+    if (min > min_vruntime)
+        min_vruntime = min;
 }
 
-pthread_t pthread_self()
+// Put a thread on the run queue and make sure someone will preempt the running thread
+static void make_ready(pthread_t tid)
 {
-    return curr_TID;
+    TRACE(TRACE_WAKE, tid, curr_TID);
+    // Time spent blocked ends here and time spent waiting for the CPU starts
+    if (TCB[tid].status == BLOCKED || TCB[tid].status == SLEEPING)
+    {
+        unsigned long long now = now_ns();
+        TCB[tid].blocked_ns += now - TCB[tid].state_since;
+        TCB[tid].state_since = now;
+    }
+    else
+        TCB[tid].state_since = now_ns();
+    TCB[tid].status = READY;
+    // Sleepers keep at most one quantum of credit so waking up does not let them take over
+    unsigned long long credit = quantum_us * 1000;
+    if (min_vruntime > credit && TCB[tid].vruntime < min_vruntime - credit)
+        TCB[tid].vruntime = min_vruntime - credit;
+    rq_push(tid);
+    tick_arm();
 }
 
-void lock()
+// The running thread is about to block, MLFQ moves it up a level for giving up the CPU early
+static void mlfq_blocked(pthread_t tid)
 {
-    // Block any incoming SIGALRMs
-    sigset_t set, oset;
-    sigemptyset(&set);
-    sigaddset(&set, SIGALRM);
-    sigprocmask(SIG_BLOCK, &set, &oset);
+    if (!TCB[tid].pinned && TCB[tid].level > 0)
+        TCB[tid].level--;
+    TCB[tid].ticks = 0;
 }
 
-void unlock()
+// Append a blocked thread to the back of a wait queue
+static void wq_push(waitqueue *wq, waiter *w)
 {
-    // Unblock any incoming SIGALRMS
-    sigset_t set, oset;
-    sigemptyset(&set);
-    sigaddset(&set, SIGALRM);
-    sigprocmask(SIG_UNBLOCK, &set, &oset);
+    w->queue = wq;
+    w->next = NULL;
+    w->prev = wq->tail;
+    if (wq->head == NULL)
+        wq->head = w;
+    else
+        wq->tail->next = w;
+    wq->tail = w;
 }
 
-int pthread_join(pthread_t thread, void **value_ptr)
+// Unlink a waiter from its queue in O(1)
+static void wq_remove(waiter *w)
 {
-    lock();
-    if (TCB[thread].status != EXITED)
-    {
-        // printf("thread %d joining thread %d\n", (unsigned int)curr_TID, (unsigned int)thread);
-        TCB[curr_TID].status = BLOCKED;
-        int joined;
-        joined = (int)setjmp(TCB[curr_TID].reg);
+    waitqueue *wq = w->queue;
 
-        // If the thread is waiting to exit, jump to it
-        if (TCB[thread].status == WAITING && !joined)
-        {
-            pthread_t waiting_thread = curr_TID;
-            curr_TID = thread;
-            // printf("jumping to thread %d with arg %d\n", (int)thread, (int)waiting_thread);
+    if (w->prev == NULL)
+        wq->head = w->next;
+    else
+        w->prev->next = w->next;
+    if (w->next == NULL)
+        wq->tail = w->prev;
+    else
+        w->next->prev = w->prev;
+    w->queue = NULL;
+}
 
-            unlock();
-            // If joining from main, longjmp cannot return a value of 0. Add an offset
-            longjmp(TCB[thread].reg, (int)waiting_thread + MAX_THREADS);
-        }
-        // If the thread is not waiting
-        else
-        {
-            // if the thread has not jumped back from pthread_exit, schedule
-            if (!joined)
-            {
-                // The result of multiple calls to the same target is undefined
-                TCB[thread].joining = curr_TID;
-                unlock();
-                scheduler();
-            }
-            // if the thread jumped back, its ready to be run again
-            else
-            {
-                if (value_ptr != NULL)
-                {
-                    // copy the value from exit to the local return ptr
-                    *value_ptr = (void *) TCB[thread].exitcode;
-                }
-                TCB[curr_TID].status = RUNNING;
-                // printf("TID %d running \n", (int)curr_TID);
-            }
-        }
-    }
+// Take the longest waiting thread off a wait queue, NULL if it is empty
+static waiter *wq_pop(waitqueue *wq)
+{
+    waiter *w = wq->head;
+    if (w != NULL)
+        wq_remove(w);
+    return w;
+}
 
-    unlock();
-    // On Success
-    return 0;
+// Queue the running thread as BLOCKED, it stays on the CPU until it calls scheduler() (SIGALRM blocked)
+static void wait_prepare(waitqueue *wq, waiter *w)
+{
+    w->tid = curr_TID;
+    wq_push(wq, w);
+    TCB[curr_TID].blocked_on = w;
+    TRACE(TRACE_BLOCK, curr_TID, w->queue);
+    TCB[curr_TID].status = BLOCKED;
+    mlfq_blocked(curr_TID);
 }
 
-int sem_init(sem_t *sem, int pshared, unsigned value)
+// Block the running thread at the back of a wait queue until wake_one picks it (SIGALRM blocked)
+static void block_on(waitqueue *wq)
 {
-    seminfo *SEB = malloc(sizeof(*SEB));
-    SEB->val = value;
-    SEB->status = INITIALIZED;
+    // The waiter lives on our own stack, which stays put while we are blocked
+    waiter w;
+    wait_prepare(wq, &w);
+    scheduler();
+}
 
-    int i = 0;
-    while (i < MAX_THREADS)
+// Make the longest waiting thread READY, return it or NO_THREAD if nobody was waiting
+static pthread_t wake_one(waitqueue *wq)
+{
+    waiter *w = wq_pop(wq);
+    if (w == NULL)
+        return NO_THREAD;
+    make_ready(w->tid);
+    return w->tid;
+}
+
+// Make every thread on a wait queue READY
+static void wake_all(waitqueue *wq)
+{
+    while (wake_one(wq) != NO_THREAD)
+        ;
+}
+
+// Wake every thread on a wait queue, return how many there were
+static int wake_count(waitqueue *wq)
+{
+    int woken = 0;
+    while (wake_one(wq) != NO_THREAD)
+        woken++;
+    return woken;
+}
+
+// Tell epoll which directions someone is waiting for on fd, level triggered so nothing is lost
+static void io_update(int fd)
+{
+    iowait *e = io_table[fd];
+    unsigned int want = (e->readers.head ? EPOLLIN : 0) | (e->writers.head ? EPOLLOUT : 0);
+    if (want == e->events && e->registered)
+        return;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = want;
+    ev.data.fd = fd;
+    // The fd may have been closed and reopened since, which drops it from the epoll set
+    if (!e->registered || epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) < 0)
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    e->registered = 1;
+    e->events = want;
+}
+
+// Park the running thread until fd is readable (EPOLLIN) or writable (EPOLLOUT) (SIGALRM blocked)
+// Return -1 with errno set, without parking, if there is no epoll instance or no memory to watch fd
+static int io_park(int fd, unsigned int events)
+{
+    if (epoll_fd < 0 && (epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        return -1;
+    if (io_table[fd] == NULL && (io_table[fd] = calloc(1, sizeof(iowait))) == NULL)
     {
-        SEB->waiting[i] = 0;
-        i++;
+        errno = ENOMEM;
+        return -1;
     }
 
-    sem->__align = (long int)SEB;
+    waiter w;
+    wait_prepare(events == EPOLLIN ? &io_table[fd]->readers : &io_table[fd]->writers, &w);
+    io_update(fd);
+    io_waiters++;
+    tick_arm();
+    scheduler();
     return 0;
 }
 
-int sem_wait(sem_t *sem)
+// Wake the threads whose file descriptors became ready, waiting up to timeout ms (-1 forever)
+// with the signal mask swapped for mask (NULL keeps it)
+static void io_poll(int timeout, const sigset_t *mask)
 {
-    seminfo *temp = (seminfo *)sem->__align;
+    struct epoll_event events[IO_EVENTS];
+    int n = epoll_pwait(epoll_fd, events, IO_EVENTS, timeout, mask);
 
-    if (temp->status == INITIALIZED)
+    int i = 0;
+    while (i < n)
     {
-        if (temp->val <= 0)
-        {
-            TCB[curr_TID].status = BLOCKED;
-            int i = 0;
-            // find the next open slot in the queue
-            while (temp->waiting[i] != 0)
-            {
-                i++;
-            }
-            temp->waiting[i] = curr_TID;
-            scheduler();
-        }
-        else if (temp->val > 0)
-        {
-            temp->val--;
-        }
+        int fd = events[i].data.fd;
+        // Errors and hangups wake both sides, their next read or write reports it
+        if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+            io_waiters -= wake_count(&io_table[fd]->readers);
+        if (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+            io_waiters -= wake_count(&io_table[fd]->writers);
+        io_update(fd);
+        i++;
     }
-    else
+}
+
+// Make sure fd will not block the whole process
+static int io_nonblock(int fd)
+{
+    if (fd < 0 || fd >= MAX_FDS)
     {
-        printf("ERROR: This semaphore is destroyed\n");
+        errno = EBADF;
         return -1;
     }
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0)
+        return -1;
+    if (!(flags & O_NONBLOCK))
+        return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
     return 0;
 }
 
-int sem_post(sem_t *sem)
+// Periodic MLFQ reset so CPU-bound threads at the bottom levels cannot starve
+static void mlfq_boost()
 {
-    seminfo *temp = (seminfo *)sem->__align;
+    pthread_t i = 0;
+    while (i < MAX_THREADS)
+    {
+        if (!TCB[i].pinned)
+        {
+            TCB[i].level = 0;
+            TCB[i].ticks = 0;
+        }
+        i++;
+    }
+    rq_rebuild();
+}
 
-    if (temp->status == INITIALIZED)
+// Start the next job of every EDF thread whose period has come around
+static void edf_release(unsigned long long now)
+{
+    pthread_t i = 0;
+    int seen = 0;
+    while (i < MAX_THREADS && seen < edf_count)
     {
-        if (temp->val == 0)
+        if (TCB[i].edf)
         {
-            // If the semaphore value is at 0, find the next waiting thread
-            int i = 0;
-            while (temp->waiting[i] == 0 && i < MAX_THREADS)
+            seen++;
+            // A job still unfinished past its deadline is a miss
+            if (!TCB[i].edf_done && !TCB[i].edf_missed && now > TCB[i].edf_abs_deadline)
             {
-                i++;
+                TCB[i].edf_misses++;
+                TCB[i].edf_missed = 1;
             }
 
-            // If there are no waiting threads, increment the semaphore value
-            if (i == MAX_THREADS)
+            if (now >= TCB[i].edf_release)
             {
-                temp->val++;
+                // Skip any periods we slept through entirely
+                while (TCB[i].edf_release + TCB[i].edf_period <= now)
+                    TCB[i].edf_release += TCB[i].edf_period;
+                TCB[i].edf_abs_deadline = TCB[i].edf_release + TCB[i].edf_deadline;
+                TCB[i].edf_release += TCB[i].edf_period;
+                TCB[i].edf_used = 0;
+                TCB[i].edf_done = 0;
+                TCB[i].edf_missed = 0;
+
+                // Waiting for this release, either done with the last job or out of budget
+                if (TCB[i].status == BLOCKED && TCB[i].edf_waiting)
+                {
+                    TCB[i].edf_waiting = 0;
+                    make_ready(i);
+                }
             }
-            // If there was a waiting thread, set it to RUNNING and then jump to it
-            else
+        }
+        i++;
+    }
+}
+
+// Earliest release an EDF thread is waiting for, 0 if none is
+static unsigned long long edf_next_release()
+{
+    unsigned long long wake = 0;
+    pthread_t i = 0;
+    int seen = 0;
+    while (i < MAX_THREADS && seen < edf_count)
+    {
+        if (TCB[i].edf)
+        {
+            seen++;
+            if (TCB[i].status == BLOCKED && TCB[i].edf_waiting && (wake == 0 || TCB[i].edf_release < wake))
+                wake = TCB[i].edf_release;
+        }
+        i++;
+    }
+    return wake;
+}
+
+// Arm the thread's timer to fire at expiry (ns), O(1)
+static void timer_add(pthread_t tid, unsigned long long expiry)
+{
+    unsigned long long tick = expiry / WHEEL_RES_NS;
+
+    // The wheel does not turn while it is empty, start it from now
+    if (timers_pending == 0)
+        wheel_tick = now_ns() / WHEEL_RES_NS - 1;
+    // Already due, put it in the next slot the wheel looks at
+    if (tick <= wheel_tick)
+        tick = wheel_tick + 1;
+
+    int slot = tick % WHEEL_SLOTS;
+    TCB[tid].tmr_expiry = expiry;
+    TCB[tid].tmr_slot = slot;
+    TCB[tid].tmr_prev = NO_THREAD;
+    TCB[tid].tmr_next = wheel[slot];
+    if (wheel[slot] != NO_THREAD)
+        TCB[wheel[slot]].tmr_prev = tid;
+    wheel[slot] = tid;
+    TCB[tid].tmr_armed = 1;
+    timers_pending++;
+}
+
+// Disarm the thread's timer, O(1)
+static void timer_cancel(pthread_t tid)
+{
+    if (!TCB[tid].tmr_armed)
+        return;
+
+    if (TCB[tid].tmr_prev == NO_THREAD)
+        wheel[TCB[tid].tmr_slot] = TCB[tid].tmr_next;
+    else
+        TCB[TCB[tid].tmr_prev].tmr_next = TCB[tid].tmr_next;
+    if (TCB[tid].tmr_next != NO_THREAD)
+        TCB[TCB[tid].tmr_next].tmr_prev = TCB[tid].tmr_prev;
+    TCB[tid].tmr_armed = 0;
+    timers_pending--;
+}
+
+// Wake a sleeping thread, or take a timed waiter off its wait queue and tell it it timed out
+static void timer_fire(pthread_t tid)
+{
+    timer_cancel(tid);
+    if (TCB[tid].status != BLOCKED && TCB[tid].status != SLEEPING)
+        return;
+
+    if (TCB[tid].blocked_on != NULL && TCB[tid].blocked_on->queue != NULL)
+        wq_remove(TCB[tid].blocked_on);
+    TCB[tid].timed_out = 1;
+    make_ready(tid);
+}
+
+// Fire every timer in one slot that is due, the others belong to later laps
+static void timer_slot(int slot, unsigned long long now)
+{
+    pthread_t i = wheel[slot];
+    while (i != NO_THREAD)
+    {
+        pthread_t next = TCB[i].tmr_next;
+        if (TCB[i].tmr_expiry <= now)
+            timer_fire(i);
+        i = next;
+    }
+}
+
+// Turn the wheel up to now
+static void timer_run(unsigned long long now)
+{
+    unsigned long long tick = now / WHEEL_RES_NS;
+
+    if (tick - wheel_tick >= WHEEL_SLOTS)
+    {
+        // More than a lap behind, every slot may have something due
+        int slot = 0;
+        while (slot < WHEEL_SLOTS)
+            timer_slot(slot++, now);
+    }
+    else
+    {
+        while (wheel_tick < tick)
+            timer_slot(++wheel_tick % WHEEL_SLOTS, now);
+    }
+
+    // The current slot may still hold timers due later in this tick, look at it again next time
+    wheel_tick = tick - 1;
+}
+
+// Earliest armed timer, 0 if there is none
+static unsigned long long timer_next()
+{
+    unsigned long long wake = 0;
+    int slot = 0;
+    while (slot < WHEEL_SLOTS && timers_pending > 0)
+    {
+        pthread_t i = wheel[slot];
+        while (i != NO_THREAD)
+        {
+            if (wake == 0 || TCB[i].tmr_expiry < wake)
+                wake = TCB[i].tmr_expiry;
+            i = TCB[i].tmr_next;
+        }
+        slot++;
+    }
+    return wake;
+}
+
+// Block like block_on but give up at expiry (ns), return 1 if it timed out (SIGALRM blocked)
+// Callers that need to do more between queueing and switching use wait_prepare and wait_timed
+static int wait_timed(unsigned long long expiry)
+{
+    TCB[curr_TID].timed_out = 0;
+    timer_add(curr_TID, expiry);
+    scheduler();
+    timer_cancel(curr_TID);
+    return TCB[curr_TID].timed_out;
+}
+
+static int block_on_timed(waitqueue *wq, unsigned long long expiry)
+{
+    waiter w;
+    wait_prepare(wq, &w);
+    return wait_timed(expiry);
+}
+
+// Turn an absolute CLOCK_REALTIME timeout into a CLOCK_MONOTONIC expiry in ns
+static unsigned long long abs_to_expiry(const struct timespec *abstime)
+{
+    struct timespec real;
+    clock_gettime(CLOCK_REALTIME, &real);
+    long long left = (abstime->tv_sec - real.tv_sec) * 1000000000LL + (abstime->tv_nsec - real.tv_nsec);
+    unsigned long long now = now_ns();
+    return left > 0 ? now + left : now;
+}
+
+// Runs on any signal handed to green_sigwait, nothing here may touch the scheduler
+static void sig_catch(int sig)
+{
+    sig_caught[sig] = 1;
+    sig_new = 1;
+}
+
+// Let the green_sigwait threads look for their signals (SIGALRM blocked)
+static void sig_deliver()
+{
+    sig_new = 0;
+    sig_waiters -= wake_count(&sig_waiting);
+}
+
+// Nothing is READY. Sleep the whole process with the tick off until a file descriptor, a timer, an EDF
+// release or a watched signal can make a thread READY. Return 0 if none of them can
+static int idle_wait()
+{
+    unsigned long long wake = edf_next_release();
+    unsigned long long timer = timer_next();
+    if (timer != 0 && (wake == 0 || timer < wake))
+        wake = timer;
+    if (wake == 0 && io_waiters == 0 && sig_waiters == 0)
+        return 0;
+    tick_disarm();
+
+    // Hold the watched signals back until we are asleep, so one arriving now cannot be slept through
+    sigset_t mask;
+    sigprocmask(SIG_BLOCK, &sig_watched, &mask);
+    if (!sig_new)
+    {
+        unsigned long long now = now_ns();
+        if (io_waiters > 0)
+            io_poll(wake == 0 ? -1 : wake <= now ? 0 : (int)((wake - now + 999999) / 1000000), &mask);
+        else if (wake == 0)
+            sigsuspend(&mask);
+        else if (wake > now)
+        {
+            struct timespec ts;
+            ts.tv_sec = (wake - now) / 1000000000ULL;
+            ts.tv_nsec = (wake - now) % 1000000000ULL;
+            pselect(0, NULL, NULL, NULL, &ts, &mask);
+        }
+    }
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+
+    unsigned long long now = now_ns();
+    if (edf_count > 0)
+        edf_release(now);
+    if (timers_pending > 0)
+        timer_run(now);
+    if (sig_new)
+        sig_deliver();
+    return 1;
+}
+
+// Nothing can ever run again, say who is stuck and on what
+static void deadlock()
+{
+    printf("Error: Deadlock, no threads ready\n");
+    pthread_t i = 0;
+    while (i < MAX_THREADS)
+    {
+        if (TCB[i].status == BLOCKED)
+        {
+            pthread_t target = 0;
+            while (target < MAX_THREADS && TCB[target].joining != i)
+                target++;
+            if (target < MAX_THREADS && TCB[target].status != FRESH && TCB[target].status != EXITED)
+                printf("  thread %d blocked joining thread %d\n", (int)i, (int)target);
+            else if (TCB[i].blocked_on != NULL && TCB[i].blocked_on->queue != NULL)
+                printf("  thread %d blocked on wait queue %p\n", (int)i, (void *)TCB[i].blocked_on->queue);
+            else
+                printf("  thread %d blocked\n", (int)i);
+        }
+        i++;
+    }
+    exit(1);
+}
+
+// Painted stacks get an inaccessible guard page below them, anything else comes from malloc
+static void *stack_alloc(int painted)
+{
+    if (!painted)
+        return malloc(STACK_SIZE);
+
+    size_t len = page_size + (STACK_SIZE + page_size - 1) / page_size * page_size;
+    char *base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+    // Without the guard page an overflow would go unnoticed, so treat it as out of memory
+    if (mprotect(base, page_size, PROT_NONE) != 0)
+    {
+        munmap(base, len);
+        return NULL;
+    }
+    memset(base + page_size, STACK_PAINT, STACK_SIZE);
+    return base + page_size;
+}
+
+static void stack_free(pthread_t tid)
+{
+    if (!TCB[tid].stack_painted)
+        free(TCB[tid].stack);
+    else
+        munmap((char *)TCB[tid].stack - page_size, page_size + (STACK_SIZE + page_size - 1) / page_size * page_size);
+    TCB[tid].stack = NULL;
+}
+
+// A fault in a guard page is a stack overflow, name the thread; anything else crashes as usual
+static void stack_fault(int sig, siginfo_t *info, void *uc)
+{
+    unsigned long addr = (unsigned long)info->si_addr;
+    pthread_t i = 0;
+    for (i = 0; i < MAX_THREADS; i++)
+    {
+        unsigned long stack = (unsigned long)TCB[i].stack;
+        if (TCB[i].stack_painted && stack != 0 && addr < stack && addr >= stack - page_size)
+        {
+            char line[128];
+            int len = snprintf(line, sizeof(line), "Error: thread %d overflowed its %d byte stack\n", (int)i, STACK_SIZE);
+            write(STDERR_FILENO, line, len);
+            abort();
+        }
+    }
+    signal(SIGSEGV, SIG_DFL);
+}
+
+// The lowest word of a thread stack was overwritten, everything below it belongs to someone else
+static void stack_verify(pthread_t tid)
+{
+    if (TCB[tid].stack != NULL && *(unsigned long *)TCB[tid].stack != STACK_CANARY)
+    {
+        fprintf(stderr, "Error: thread %d overflowed its %d byte stack\n", (int)tid, STACK_SIZE);
+        abort();
+    }
+}
+
+// Bytes of a painted stack that have ever been used, found by scanning up for the first unpainted byte
+static long stack_high_water(pthread_t tid)
+{
+    if (TCB[tid].stack == NULL || !TCB[tid].stack_painted)
+        return -1;
+    unsigned char *p = (unsigned char *)TCB[tid].stack + sizeof(unsigned long);
+    unsigned char *end = (unsigned char *)TCB[tid].stack + STACK_SIZE;
+    while (p < end && *p == STACK_PAINT)
+        p++;
+    return end - p;
+}
+
+// Give an unused slot back to pthread_create
+static void slot_release(pthread_t tid)
+{
+    TCB[tid].status = FRESH;
+    free_slots[free_count++] = tid;
+}
+
+// Free the stack of a detached thread that exited, now that we are off it (SIGALRM blocked)
+static void reap()
+{
+    if (reap_tid == NO_THREAD)
+        return;
+    stack_free(reap_tid);
+    slot_release(reap_tid);
+    total_threads--;
+    reap_tid = NO_THREAD;
+}
+
+// New threads start here with SIGALRM still blocked by the scheduler that switched to them
+static void thread_start(pthread_t tid)
+{
+    reap();
+    unlock();
+    pthread_exit(TCB[tid].start_routine(TCB[tid].arg));
+}
+
+// Pick up ready file descriptors without waiting, and wake sleepers and signal waiters that are due
+static void poll_events()
+{
+    if (io_waiters > 0)
+        io_poll(0, NULL);
+    if (timers_pending > 0)
+        timer_run(now_ns());
+    if (sig_new)
+        sig_deliver();
+}
+
+/*
+    Point a context at entry(arg) on a fresh STACK_SIZE stack, used for threads and coroutines
+    entry returns to exit_addr
+*/
+static void context_init(jmp_buf reg, void *stack, void (*entry)(long), long arg, void *exit_addr)
+{
+    // set first jump
+    setjmp(reg);
+
+    // jmpbug stores long int types, addresses are unsigned
+    // Set the argument to entry to R13 in jmpbuf
+    reg->__jmpbuf[JB_R13] = arg;
+    // Set entry to R12 in jmpbuf, start_thunk calls it
+    reg->__jmpbuf[JB_R12] = (unsigned long int)entry;
+    // Set the program counter (RIP) to start_thunk
+    reg->__jmpbuf[JB_PC] = ptr_mangle((unsigned long int)start_thunk);
+
+    /*
+        Before we set the stack pointer in the RSP register, we need to put
+        exit_addr (pthread_exit for threads) at the beginning of the stack,
+        so a thread automatically exits at the end of its runtime
+    */
+
+    // The "top" of the stack starts at 32767, keep it 16 byte aligned as the ABI expects
+    // Allocate enough space for the exit function, function address is 8bytes long
+    void *topspace = (void *)(((unsigned long int)stack + STACK_SIZE) & ~15UL) - 8;
+
+    // Copy the address into the stack
+    memcpy(topspace, &exit_addr, 8);
+
+    // Set the stack pointer (RSP) to the start of the stack after the address of the exit function
+    reg->__jmpbuf[JB_RSP] = ptr_mangle((unsigned long int)topspace);
+}
+
+void scheduler()
+{
+    // Keep SIGALRM out while the run queue changes, the old mask is restored once we run again
+    // Without preemption there is no SIGALRM, so do the tick's polling here instead
+    sigset_t set, oset;
+    if (preempt)
+    {
+        sigemptyset(&set);
+        sigaddset(&set, SIGALRM);
+        sigprocmask(SIG_BLOCK, &set, &oset);
+    }
+    else
+        poll_events();
+    account(curr_TID);
+    // Whatever the thread does next, READY or BLOCKED, starts now
+    TCB[curr_TID].state_since = TCB[curr_TID].switched_in;
+    int preempted = preempting;
+    preempting = 0;
+
+    // Change the status of the currently running thread to READY and put it back in line
+    if (TCB[curr_TID].status == RUNNING)
+    {
+        TCB[curr_TID].status = READY;
+        rq_push(curr_TID);
+    }
+
+    // Find the next thread that is ready, EDF threads may have to be released first
+    if (edf_count > 0)
+        edf_release(now_ns());
+    pthread_t next = NO_THREAD;
+    if (handoff_to != NO_THREAD && TCB[handoff_to].status == READY)
+    {
+        // Direct handoff, run the thread that was just woken ahead of everyone else
+        rq_remove(handoff_to);
+        next = handoff_to;
+    }
+    else if (deterministic)
+        next = det_pick();
+    else
+        next = rq_pop();
+    handoff_to = NO_THREAD;
+    if (next == NO_THREAD && sig_new)
+    {
+        sig_deliver();
+        next = rq_pop();
+    }
+    while (next == NO_THREAD && idle_wait())
+        next = rq_pop();
+    // A fresh checkpoint budget for whoever runs next
+    det_left = det_checkpoints;
+    if (next == NO_THREAD)
+    {
+        // Every thread has exited, unless someone is still blocked with nobody left to wake it
+        pthread_t i = 0;
+        while (i < MAX_THREADS && TCB[i].status != BLOCKED)
+            i++;
+        if (i == MAX_THREADS)
+            exit(0);
+        deadlock();
+    }
+
+    // Tickless: the timer only runs while another thread is waiting for the CPU, an EDF release is due,
+    // a sleeper has to be woken or file descriptors and signals have to be polled
+    // (the profiler keeps it running to take its samples)
+    if (rq_len > 0 || edf_count > 0 || timers_pending > 0 || io_waiters > 0 || sig_waiters > 0 || prof_on)
+        tick_arm();
+    else
+        tick_disarm();
+
+    // Picked ourselves again, nothing to switch
+    if (next == curr_TID)
+    {
+        TCB[curr_TID].status = RUNNING;
+        TCB[curr_TID].switched_in = now_ns();
+        if (preempt)
+            sigprocmask(SIG_SETMASK, &oset, NULL);
+        return;
+    }
+
+    // Save the state unless the thread has exited and will never be resumed
+    int jumped = 0;
+    if (TCB[curr_TID].status == READY || TCB[curr_TID].status == BLOCKED || TCB[curr_TID].status == SLEEPING)
+        jumped = setjmp(TCB[curr_TID].reg);
+
+    // setjmp returns 0 if returning directly, and nonzero when returning from longjmp
+    // if we're just returning from a longjmp, don't longjmp again
+    if (!jumped)
+    {
+        // Catch a thread that ran off the bottom of its stack before anyone else runs on the damage
+        stack_verify(curr_TID);
+
+        // Count why the old thread left the CPU, an exited thread no longer matters
+        if (preempted)
+            TCB[curr_TID].nr_involuntary++;
+        else if (TCB[curr_TID].status != WAITING)
+            TCB[curr_TID].nr_voluntary++;
+        stat_switches++;
+        TRACE(TRACE_SWITCH_OUT, curr_TID, TCB[curr_TID].status);
+        TRACE(TRACE_SWITCH_IN, next, preempted);
+
+        // Update the current running thread
+        curr_TID = next;
+        green_self = &TCB[next];
+        TCB[curr_TID].status = RUNNING;
+        TCB[curr_TID].switched_in = now_ns();
+        TCB[curr_TID].ready_ns += TCB[curr_TID].switched_in - TCB[curr_TID].state_since;
+        TCB[curr_TID].nr_runs++;
+
+        // Return 1 to the setjmp that its calling back to
+        longjmp(TCB[next].reg, 1);
+    }
+    reap();
+
+    if (preempt)
+        sigprocmask(SIG_SETMASK, &oset, NULL);
+}
+
+// SIGALRM handler, the kernel keeps SIGALRM blocked until we return or switch away
+// Record where the interrupted thread was: its PC, then return addresses up the frame pointer chain
+static void prof_sample(ucontext_t *uc)
+{
+    if (prof_len >= PROF_SAMPLES)
+    {
+        prof_dropped++;
+        return;
+    }
+
+    // Only follow frames that stay inside the stack we are running on
+    unsigned long sp = uc->uc_mcontext.gregs[GREG_RSP];
+    unsigned long lo = sp, hi;
+    if (TCB[curr_TID].coro != NULL)
+        hi = (unsigned long)TCB[curr_TID].coro->stack + STACK_SIZE;
+    else if (TCB[curr_TID].stack != NULL)
+        hi = (unsigned long)TCB[curr_TID].stack + STACK_SIZE;
+    else
+        hi = (unsigned long)__libc_stack_end;
+
+    profSample *s = &prof_buf[prof_len++];
+    s->tid = (int)curr_TID;
+    s->pc[0] = (void *)uc->uc_mcontext.gregs[GREG_RIP];
+    s->depth = 1;
+    unsigned long *frame = (unsigned long *)uc->uc_mcontext.gregs[GREG_RBP];
+    while (s->depth < PROF_DEPTH && (unsigned long)frame >= lo && (unsigned long)frame + 16 <= hi &&
+           ((unsigned long)frame & 7) == 0 && frame[1] != 0 && frame[1] != (unsigned long)pthread_exit_wrapper)
+    {
+        // Step back into the call instruction so it is credited to the caller
+        s->pc[s->depth++] = (void *)(frame[1] - 1);
+        // Frames only get older going up the stack
+        if (frame[0] <= (unsigned long)frame)
+            break;
+        frame = (unsigned long *)frame[0];
+    }
+}
+
+static void tick_handler(int sig, siginfo_t *info, void *uc)
+{
+    if (prof_on)
+        prof_sample(uc);
+    stack_verify(curr_TID);
+    stat_ticks++;
+    preempting = 1;
+    poll_events();
+
+    if (edf_count > 0)
+    {
+        account(curr_TID);
+        edf_release(now_ns());
+
+        // An EDF thread out of budget waits for its next period
+        if (TCB[curr_TID].edf && TCB[curr_TID].edf_used >= TCB[curr_TID].edf_budget)
+        {
+            TCB[curr_TID].status = BLOCKED;
+            TCB[curr_TID].edf_waiting = 1;
+            scheduler();
+            return;
+        }
+
+        // A READY EDF thread with an earlier deadline preempts right away
+        if (edf_heap.len > 0 && (!TCB[curr_TID].edf ||
+            TCB[edf_heap.item[0]].edf_abs_deadline < TCB[curr_TID].edf_abs_deadline))
+        {
+            scheduler();
+            return;
+        }
+    }
+
+    if (policy == GREEN_SCHED_MLFQ)
+    {
+        if (++boost_ticks >= MLFQ_BOOST_TICKS)
+        {
+            boost_ticks = 0;
+            mlfq_boost();
+        }
+
+        // Keep running until the allotment for this level is used up, unless a higher level is waiting
+        int lvl = 0;
+        while (lvl < TCB[curr_TID].level && rq_head[lvl] == NO_THREAD)
+            lvl++;
+        if (++TCB[curr_TID].ticks < (1 << TCB[curr_TID].level) && lvl == TCB[curr_TID].level)
+        {
+            preempting = 0;
+            return;
+        }
+
+        // Used the whole quantum, demote
+        if (TCB[curr_TID].ticks >= (1 << TCB[curr_TID].level))
+        {
+            if (!TCB[curr_TID].pinned && TCB[curr_TID].level < MLFQ_LEVELS - 1)
+                TCB[curr_TID].level++;
+            TCB[curr_TID].ticks = 0;
+        }
+    }
+
+    scheduler();
+}
+
+// SIGUSR1 dumps the stats to stderr, unless the program has its own use for it
+static void stats_signal(int sig)
+{
+    green_stats_dump(STDERR_FILENO);
+}
+
+void init_system()
+{
+    // initialize all TCB states to FRESH and set their id to their array index on first call
+    pthread_t i = 0;
+    while (i < MAX_THREADS)
+    {
+        TCB[i].status = FRESH;
+        TCB[i].id = i;
+        TCB[i].joining = NO_THREAD;
+        TCB[i].rq_next = NO_THREAD;
+        TCB[i].rq_prev = NO_THREAD;
+        TCB[i].level = 0;
+        TCB[i].ticks = 0;
+        TCB[i].pinned = 0;
+        TCB[i].weight = DEFAULT_WEIGHT;
+        TCB[i].vruntime = 0;
+        TCB[i].runtime = 0;
+        TCB[i].switched_in = 0;
+        TCB[i].edf = 0;
+        TCB[i].tmr_armed = 0;
+        TCB[i].blocked_on = NULL;
+        i++;
+    }
+    int slot = 0;
+    while (slot < WHEEL_SLOTS)
+        wheel[slot++] = NO_THREAD;
+    // Slot 0 is main, hand out the rest lowest first
+    for (i = MAX_THREADS - 1; i > 0; i--)
+        free_slots[free_count++] = i;
+    int lvl = 0;
+    while (lvl < MLFQ_LEVELS)
+    {
+        rq_head[lvl] = NO_THREAD;
+        rq_tail[lvl] = NO_THREAD;
+        lvl++;
+    }
+
+    // The time slice can be overridden from the environment, in microseconds
+    char *env = getenv("GREEN_QUANTUM_US");
+    if (env != NULL && strtoul(env, NULL, 10) >= MIN_QUANTUM_US)
+        quantum_us = strtoul(env, NULL, 10);
+
+    // Dump the scheduler stats on SIGUSR1 if nobody else handles it
+    struct sigaction usr1;
+    if (sigaction(SIGUSR1, NULL, &usr1) == 0 && usr1.sa_handler == SIG_DFL)
+    {
+        memset(&usr1, 0, sizeof(usr1));
+        usr1.sa_handler = stats_signal;
+        usr1.sa_flags = SA_RESTART;
+        sigemptyset(&usr1.sa_mask);
+        sigaddset(&usr1.sa_mask, SIGALRM);
+        sigaction(SIGUSR1, &usr1, NULL);
+    }
+
+    // GREEN_TRACE=file records a scheduler trace into file
+    env = getenv("GREEN_TRACE");
+    if (env != NULL && *env != '\0')
+        green_trace_start(env);
+
+    // GREEN_PROF=file profiles every thread into file
+    env = getenv("GREEN_PROF");
+    if (env != NULL && *env != '\0')
+        green_prof_start(env);
+
+    // GREEN_STACK_PAINT=1 paints stacks for high-water marks
+    env = getenv("GREEN_STACK_PAINT");
+    if (env != NULL && strcmp(env, "1") == 0)
+        green_set_stack_paint(1);
+    page_size = sysconf(_SC_PAGESIZE);
+
+    // GREEN_PREEMPT=0 makes scheduling cooperative, see green_set_preemption
+    env = getenv("GREEN_PREEMPT");
+    if (env != NULL && strcmp(env, "0") == 0)
+        preempt = 0;
+
+    // GREEN_SEED=n runs deterministically, GREEN_CHECKPOINTS=k sets the slice, see green_set_deterministic
+    env = getenv("GREEN_SEED");
+    if (env != NULL && *env != '\0')
+    {
+        char *slice = getenv("GREEN_CHECKPOINTS");
+        green_set_deterministic(strtoull(env, NULL, 0), slice != NULL ? strtol(slice, NULL, 10) : DET_CHECKPOINTS);
+    }
+
+    // So can the scheduling policy
+    env = getenv("GREEN_SCHED");
+    if (env != NULL && strcmp(env, "mlfq") == 0)
+        policy = GREEN_SCHED_MLFQ;
+    else if (env != NULL && strcmp(env, "fair") == 0)
+        policy = GREEN_SCHED_FAIR;
+
+    // Deliver SIGALRM from a monotonic timer, it is only armed once a second thread is READY
+    struct sigevent sev;
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_SIGNAL;
+    sev.sigev_signo = SIGALRM;
+    timer_create(CLOCK_MONOTONIC, &sev, &tick_timer);
+
+    // SIGALARM handler
+    // When the alarm handler is triggered, account the tick and call the scheduler
+    alrm_handler.sa_sigaction = &tick_handler;
+    // SIGALRM stays blocked while the handler runs, the scheduler restores each thread's own mask
+    // The profiler reads the interrupted registers from the siginfo context
+    alrm_handler.sa_flags = SA_SIGINFO;
+    sigemptyset(&alrm_handler.sa_mask);
+    // When SIGALRM is caught, trigger the alarm handler
+    sigaction(SIGALRM, &alrm_handler, NULL);
+}
+
+// Bring the runtime up on first use and hold onto the main thread as thread 0
+// pthread_create and every call that may block go through here, so waits work with no other thread yet
+static void runtime_start()
+{
+    if (!first_call)
+        return;
+    // printf("initializing system\n");
+    init_system();
+    first_call = 0;
+    TCB[0].status = RUNNING;
+    TCB[0].switched_in = now_ns();
+    total_threads++;
+}
+
+int pthread_create(
+    pthread_t *thread,
+    const pthread_attr_t *attr,
+    void *(*start_routine)(void *),
+    void *arg)
+{
+    lock();
+    runtime_start();
+
+    // If there are already a MAX amount of threads, return
+    if (total_threads >= MAX_THREADS)
+    {
+        printf("Error: Maximum Thread amount reached\n");
+        unlock();
+        return -1;
+    }
+
+    // Take the lowest free slot, exited threads give theirs back once joined or reaped
+    if (free_count == 0)
+    {
+        printf("Error: Maximum Thread amount reached\n");
+        unlock();
+        return -1;
+    }
+    pthread_t i = free_slots[--free_count];
+    // Set input thread to the id of TCB
+    *thread = i;
+    TCB[i].start_routine = start_routine;
+    TCB[i].arg = arg;
+    TCB[i].joining = NO_THREAD;
+    TCB[i].level = 0;
+    TCB[i].ticks = 0;
+    TCB[i].pinned = 0;
+    TCB[i].weight = DEFAULT_WEIGHT;
+    TCB[i].vruntime = min_vruntime;
+    TCB[i].runtime = 0;
+    TCB[i].edf = 0;
+    TCB[i].task_deque = 0;
+    TCB[i].coro = NULL;
+    TCB[i].blocked_on = NULL;
+    memset(TCB[i].specific, 0, sizeof(TCB[i].specific));
+    TCB[i].nr_runs = 0;
+    TCB[i].nr_voluntary = 0;
+    TCB[i].nr_involuntary = 0;
+    TCB[i].ready_ns = 0;
+    TCB[i].blocked_ns = 0;
+    TCB[i].sem_wait_ns = 0;
+
+    // Detached threads clean up after themselves, nobody may join them
+    int detach = PTHREAD_CREATE_JOINABLE;
+    TCB[i].detached = attr != NULL && pthread_attr_getdetachstate(attr, &detach) == 0 &&
+                      detach == PTHREAD_CREATE_DETACHED;
+
+    // A priority set with pthread_attr_setschedparam pins the thread, see pthread_setschedprio
+    // (glibc only stores one once the attr policy is SCHED_FIFO or SCHED_RR, the policy itself is ignored)
+    struct sched_param param;
+    if (attr != NULL && pthread_attr_getschedparam(attr, &param) == 0 &&
+        param.sched_priority > 0 && param.sched_priority <= MLFQ_LEVELS)
+    {
+        TCB[i].pinned = 1;
+        TCB[i].level = MLFQ_LEVELS - param.sched_priority;
+    }
+
+    // Allocate the stack, the first jump goes to thread_start(i) which ends in pthread_exit
+    // Its bottom word is a canary checked on every switch, painting (with a guard page) is optional
+    TCB[i].stack = stack_alloc(stack_paint);
+    if (TCB[i].stack == NULL)
+    {
+        // Out of memory or mappings (two per painted stack count against vm.max_map_count), give the slot back
+        free_slots[free_count++] = i;
+        unlock();
+        return EAGAIN;
+    }
+    TCB[i].stack_painted = stack_paint;
+    TCB[i].stack_used = -1;
+    *(unsigned long *)TCB[i].stack = STACK_CANARY;
+    context_init(TCB[i].reg, TCB[i].stack, (void (*)(long))thread_start, (long)i, (void *)&pthread_exit_wrapper);
+
+    // After the thread is setup, it is ready to run
+    total_threads++;
+    TRACE(TRACE_CREATE, curr_TID, i);
+    make_ready(i);
+
+    // Optional: Choose whether or not to run the scheduler after a new thread is created
+    // scheduler();
+
+    unlock();
+    // On successful call, reach the end and return 0
+    return 0;
+}
+
+void pthread_exit(void *value_ptr)
+{
+    // Run the destructors of our non-NULL keys, again if they set new values, like POSIX a few times at most
+    int round = 0, again = 1;
+    while (again && round++ < KEY_DESTRUCTOR_ROUNDS)
+    {
+        again = 0;
+        pthread_key_t k = 0;
+        for (k = 0; k < GREEN_KEYS; k++)
+        {
+            void *value = green_self->specific[k];
+            if (value != NULL && key_used[k] && key_dtor[k] != NULL)
+            {
+                green_self->specific[k] = NULL;
+                key_dtor[k](value);
+                again = 1;
+            }
+        }
+    }
+
+    lock();
+    // Change the status of the thread to waiting to be joined and keep the exit value for pthread_join
+    //("pthread_exit called on thread %d\n", (int)curr_TID);
+    TCB[curr_TID].status = WAITING;
+    TCB[curr_TID].exitcode = value_ptr;
+    TRACE(TRACE_EXIT, curr_TID, value_ptr);
+
+    // Keep the high-water mark now, the stack goes away with pthread_join
+    TCB[curr_TID].stack_used = stack_high_water(curr_TID);
+    if (TCB[curr_TID].stack_used >= 0)
+        stack_hist[TCB[curr_TID].stack_used / 1024]++;
+
+    // Give the EDF reservation back
+    if (TCB[curr_TID].edf)
+    {
+        TCB[curr_TID].edf = 0;
+        edf_count--;
+        edf_density -= TCB[curr_TID].edf_density;
+    }
+
+    // Hand the task deque on, tasks still in it stay visible to the thieves and to its next owner
+    if (TCB[curr_TID].task_deque > 0)
+    {
+        task_free_deques[task_nfree++] = TCB[curr_TID].task_deque;
+        TCB[curr_TID].task_deque = 0;
+    }
+
+    // there is a thread waiting to join this thread, it frees our stack once we are gone
+    if (TCB[curr_TID].joining != NO_THREAD)
+        make_ready(TCB[curr_TID].joining);
+
+    // Nobody will join a detached thread, whoever runs next frees the stack and the slot
+    if (TCB[curr_TID].detached && curr_TID != 0)
+    {
+        TCB[curr_TID].status = EXITED;
+        reap_tid = curr_TID;
+    }
+
+    // Never returns, the scheduler exits the process once no threads are left
+    scheduler();
+    exit(0);
+}
+
+void pthread_exit_wrapper()
+{
+    unsigned long int res;
+    asm("movq %%rax, %0\n"
+        : "=r"(res));
+    pthread_exit((void *)res);
+}
+
+int pthread_detach(pthread_t thread)
+{
+    if (thread >= MAX_THREADS)
+        return ESRCH;
+
+    lock();
+    if (TCB[thread].status == FRESH || TCB[thread].status == EXITED)
+    {
+        unlock();
+        return ESRCH;
+    }
+    if (TCB[thread].detached || TCB[thread].joining != NO_THREAD)
+    {
+        unlock();
+        return EINVAL;
+    }
+
+    // Already exited and waiting to be joined, nobody is on its stack so clean up now
+    if (TCB[thread].status == WAITING && thread != 0)
+    {
+        stack_free(thread);
+        slot_release(thread);
+        total_threads--;
+    }
+    else
+        TCB[thread].detached = 1;
+    unlock();
+    return 0;
+}
+
+int pthread_key_create(pthread_key_t *key, void (*destructor)(void *))
+{
+    lock();
+    pthread_key_t k = 0;
+    while (k < GREEN_KEYS && key_used[k])
+        k++;
+    if (k == GREEN_KEYS)
+    {
+        unlock();
+        return EAGAIN;
+    }
+
+    // A key that was deleted and handed out again starts out NULL everywhere
+    pthread_t i = 0;
+    for (i = 0; i < MAX_THREADS; i++)
+        TCB[i].specific[k] = NULL;
+    key_used[k] = 1;
+    key_dtor[k] = destructor;
+    *key = k;
+    unlock();
+    return 0;
+}
+
+int pthread_key_delete(pthread_key_t key)
+{
+    if (key >= GREEN_KEYS || !key_used[key])
+        return EINVAL;
+    // Destructors are not run, as in POSIX
+    key_used[key] = 0;
+    return 0;
+}
+
+void *pthread_getspecific(pthread_key_t key)
+{
+    return key < GREEN_KEYS ? green_self->specific[key] : NULL;
+}
+
+int pthread_setspecific(pthread_key_t key, const void *value)
+{
+    if (key >= GREEN_KEYS || !key_used[key])
+        return EINVAL;
+    green_self->specific[key] = (void *)value;
+    return 0;
+}
+
+int pthread_yield()
+{
+    // Nobody else to run yet
+    if (first_call)
+        return 0;
+
+    lock();
+    scheduler();
+    unlock();
+    return 0;
+}
+
+int sched_yield()
+{
+    return pthread_yield();
+}
+
+int green_set_preemption(int on)
+{
+    // Switching once threads exist could leave one of them with SIGALRM blocked for good
+    if (!first_call)
+        return -1;
+    preempt = on != 0;
+    return 0;
+}
+
+int green_set_deterministic(unsigned long long seed, long checkpoints)
+{
+    if (!first_call || checkpoints < 0)
+        return -1;
+    // The timer would make the interleaving depend on how fast the machine is
+    deterministic = 1;
+    preempt = 0;
+    det_state = seed;
+    det_checkpoints = checkpoints;
+    det_left = checkpoints;
+    return 0;
+}
+
+void green_sleep(unsigned long usec)
+{
+    lock();
+    if (first_call || usec == 0)
+    {
+        // Nobody else to run, or just giving up the rest of the slice
+        if (first_call)
+            usleep(usec);
+        else
+            scheduler();
+        unlock();
+        return;
+    }
+
+    // Off the run queue until the wheel fires our timer
+    TCB[curr_TID].blocked_on = NULL;
+    TCB[curr_TID].status = SLEEPING;
+    mlfq_blocked(curr_TID);
+    wait_timed(now_ns() + usec * 1000ULL);
+    unlock();
+}
+
+int green_sigwait(const sigset_t *set, int *sig)
+{
+    lock();
+    // Route the signals through sig_catch the first time anyone waits for them
+    int s = 1;
+    while (s < NSIG)
+    {
+        if (sigismember(set, s) == 1 && !sigismember(&sig_watched, s))
+        {
+            struct sigaction act;
+            memset(&act, 0, sizeof(act));
+            act.sa_handler = sig_catch;
+            act.sa_flags = SA_RESTART;
+            sigemptyset(&act.sa_mask);
+            sigaction(s, &act, NULL);
+            sigaddset(&sig_watched, s);
+        }
+        s++;
+    }
+
+    while (1)
+    {
+        for (s = 1; s < NSIG; s++)
+        {
+            if (sig_caught[s] && sigismember(set, s) == 1)
+            {
+                sig_caught[s] = 0;
+                *sig = s;
+                unlock();
+                return 0;
+            }
+        }
+        if (first_call)
+        {
+            // No other threads yet, just sleep the process until a signal comes in
+            sigset_t mask;
+            sigprocmask(SIG_BLOCK, &sig_watched, &mask);
+            if (!sig_new)
+                sigsuspend(&mask);
+            sig_new = 0;
+            sigprocmask(SIG_SETMASK, &mask, NULL);
+            continue;
+        }
+        // Every caught signal wakes all the waiters, the ones it is not for go back to sleep
+        sig_waiters++;
+        block_on(&sig_waiting);
+    }
+}
+
+int green_trace_start(const char *path)
+{
+    if (trace_on)
+        return -1;
+    if (trace_buf == NULL && (trace_buf = malloc(TRACE_EVENTS * sizeof(traceEvent))) == NULL)
+        return -1;
+
+    free(trace_path);
+    trace_path = strdup(path);
+    trace_next = 0;
+    trace_ns0 = now_ns();
+    trace_tsc0 = __rdtsc();
+
+    // Written when the process exits unless green_trace_stop got there first
+    static int registered = 0;
+    if (!registered)
+    {
+        atexit(green_trace_stop);
+        registered = 1;
+    }
+    trace_on = 1;
+    return 0;
+}
+
+static const char *trace_names[] = {"run", "switch out", "create", "exit", "join",
+                                    "sem_wait", "sem_post", "block", "wake"};
+
+void green_trace_stop()
+{
+    if (!trace_on)
+        return;
+    trace_on = 0;
+
+    FILE *out = fopen(trace_path, "w");
+    if (out == NULL)
+    {
+        printf("Error: cannot write trace to %s\n", trace_path);
+        return;
+    }
+
+    // Convert TSC ticks to microseconds with the rate measured over the whole trace
+    double us_per_tsc = (now_ns() - trace_ns0) / 1000.0 / (double)(__rdtsc() - trace_tsc0);
+    unsigned long n = trace_next < TRACE_EVENTS ? trace_next : TRACE_EVENTS;
+    unsigned long first = trace_next - n;
+    unsigned long long *run_start = calloc(MAX_THREADS, sizeof(unsigned long long));
+
+    fprintf(out, "{\"traceEvents\":[\n");
+    fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"green threads\"}}");
+    unsigned long k = 0;
+    for (k = first; k < first + n; k++)
+    {
+        traceEvent *e = &trace_buf[k % TRACE_EVENTS];
+        double ts = (e->tsc - trace_tsc0) * us_per_tsc;
+
+        // A run slice goes from switch in to switch out, slices cut off by the wrap are dropped
+        if (e->type == TRACE_SWITCH_IN)
+            run_start[e->tid] = e->tsc;
+        else if (e->type == TRACE_SWITCH_OUT)
+        {
+            if (run_start[e->tid] != 0)
+            {
+                double start = (run_start[e->tid] - trace_tsc0) * us_per_tsc;
+                fprintf(out, ",\n{\"name\":\"run\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+                        "\"args\":{\"left as\":\"%s\"}}", e->tid, start, ts - start, status_names[e->arg]);
+            }
+            run_start[e->tid] = 0;
+        }
+        else
+            fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,"
+                    "\"args\":{\"arg\":\"%#llx\"}}", trace_names[e->type], e->tid, ts, e->arg);
+    }
+    fprintf(out, "\n]}\n");
+    fclose(out);
+    free(run_start);
+}
+
+int green_prof_start(const char *path)
+{
+    if (prof_on)
+        return -1;
+    if (prof_buf == NULL && (prof_buf = malloc(PROF_SAMPLES * sizeof(profSample))) == NULL)
+        return -1;
+
+    free(prof_path);
+    prof_path = strdup(path);
+    prof_len = 0;
+    prof_dropped = 0;
+
+    static int registered = 0;
+    if (!registered)
+    {
+        atexit(green_prof_stop);
+        registered = 1;
+    }
+    lock();
+    prof_on = 1;
+    // Even a lone thread gets ticks while we profile
+    tick_arm();
+    unlock();
+    return 0;
+}
+
+static int prof_compare(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+void green_prof_stop()
+{
+    if (!prof_on)
+        return;
+    lock();
+    prof_on = 0;
+    unlock();
+
+    FILE *out = fopen(prof_path, "w");
+    char **lines = malloc((prof_len + 1) * sizeof(char *));
+    if (out == NULL || lines == NULL)
+    {
+        printf("Error: cannot write profile to %s\n", prof_path);
+        if (out != NULL)
+            fclose(out);
+        free(lines);
+        return;
+    }
+
+    // One line per sample, outermost frame first: "thread 3;main;work;leaf"
+    int i = 0;
+    for (i = 0; i < prof_len; i++)
+    {
+        profSample *s = &prof_buf[i];
+        char **names = backtrace_symbols(s->pc, s->depth);
+        char line[4096];
+        int len = snprintf(line, sizeof(line), "thread %d", s->tid);
+        int d = s->depth - 1;
+        for (; d >= 0 && len < (int)sizeof(line) - 1; d--)
+        {
+            // backtrace_symbols gives "binary(function+0x1f) [0x...]", keep the function
+            char *name = names == NULL ? NULL : strchr(names[d], '(');
+            char *end = name == NULL ? NULL : strpbrk(name, "+)");
+            if (name != NULL && end != NULL && end > name + 1)
+                len += snprintf(line + len, sizeof(line) - len, ";%.*s", (int)(end - name - 1), name + 1);
+            else
+                len += snprintf(line + len, sizeof(line) - len, ";%p", s->pc[d]);
+        }
+        free(names);
+        lines[i] = strdup(line);
+    }
+
+    // Collapse identical stacks into "stack count", the input flamegraph.pl expects
+    qsort(lines, prof_len, sizeof(char *), prof_compare);
+    for (i = 0; i < prof_len;)
+    {
+        int j = i;
+        while (j < prof_len && strcmp(lines[i], lines[j]) == 0)
+            j++;
+        fprintf(out, "%s %d\n", lines[i], j - i);
+        i = j;
+    }
+    if (prof_dropped > 0)
+        fprintf(stderr, "green profiler: buffer full, %lu samples dropped\n", prof_dropped);
+
+    for (i = 0; i < prof_len; i++)
+        free(lines[i]);
+    free(lines);
+    fclose(out);
+}
+
+void green_stats_dump(int fd)
+{
+    char line[256];
+    int len;
+
+    // Not lock()/unlock(): from the SIGUSR1 handler unlock() would let a pending tick (or a deterministic
+    // checkpoint) run the scheduler in the middle of whatever we interrupted, so put the old mask back instead
+    sigset_t set, oset;
+    sigemptyset(&set);
+    sigaddset(&set, SIGALRM);
+    sigprocmask(SIG_BLOCK, &set, &oset);
+    len = snprintf(line, sizeof(line), "green stats: %llu ticks, %llu switches, %d threads\n"
+                   "  tid  state       runs    voluntary  involuntary   run_ms  ready_ms  blocked_ms  semwait_ms  stack\n",
+                   stat_ticks, stat_switches, total_threads);
+    write(fd, line, len);
+
+    pthread_t i = 0;
+    while (i < MAX_THREADS && !first_call)
+    {
+        thread *t = &TCB[i];
+        if (t->status != FRESH && t->status != EXITED)
+        {
+            // The running thread's current slice has not been accounted yet
+            unsigned long long run = t->runtime + (i == curr_TID ? now_ns() - t->switched_in : 0);
+            // Stack high-water mark in bytes, -1 unless it was painted
+            long used = t->status == WAITING ? t->stack_used : stack_high_water(i);
+            len = snprintf(line, sizeof(line), "%5d  %-8s %7lu  %11lu  %11lu  %7.1f  %8.1f  %10.1f  %10.1f  %5ld\n",
+                           (int)i, status_names[t->status], t->nr_runs, t->nr_voluntary, t->nr_involuntary,
+                           run / 1e6, t->ready_ns / 1e6, t->blocked_ns / 1e6, t->sem_wait_ns / 1e6, used);
+            write(fd, line, len);
+        }
+        i++;
+    }
+
+    // High-water marks of painted threads that have exited, in KiB buckets
+    int b = 0;
+    for (b = 0; b < STACK_BUCKETS; b++)
+    {
+        if (stack_hist[b] == 0)
+            continue;
+        len = snprintf(line, sizeof(line), "  stack %2d-%2d KiB: %lu threads\n", b, b + 1, stack_hist[b]);
+        write(fd, line, len);
+    }
+    sigprocmask(SIG_SETMASK, &oset, NULL);
+}
+
+int green_set_stack_paint(int on)
+{
+    stack_paint = on != 0;
+    if (!stack_paint)
+        return 0;
+
+    // The overflow report runs on its own stack, the faulting one has no room left
+    static int installed = 0;
+    if (!installed)
+    {
+        stack_t alt;
+        alt.ss_sp = malloc(65536);
+        alt.ss_size = 65536;
+        alt.ss_flags = 0;
+        sigaltstack(&alt, NULL);
+
+        struct sigaction act;
+        memset(&act, 0, sizeof(act));
+        act.sa_sigaction = stack_fault;
+        act.sa_flags = SA_SIGINFO | SA_ONSTACK;
+        sigemptyset(&act.sa_mask);
+        sigaction(SIGSEGV, &act, NULL);
+        installed = 1;
+    }
+    return 0;
+}
+
+long green_stack_used(pthread_t thread)
+{
+    if (thread >= MAX_THREADS)
+        return -1;
+    lock();
+    long used = TCB[thread].status == WAITING || TCB[thread].status == EXITED ? TCB[thread].stack_used : stack_high_water(thread);
+    unlock();
+    return used;
+}
+
+int green_set_quantum(unsigned long usec)
+{
+    if (usec < MIN_QUANTUM_US)
+        return -1;
+
+    lock();
+    quantum_us = usec;
+    // Restart the timer so the new slice takes effect immediately
+    if (tick_armed)
+    {
+        tick_disarm();
+        tick_arm();
+    }
+    unlock();
+    return 0;
+}
+
+int green_set_policy(enum greenPolicy new_policy)
+{
+    if (new_policy != GREEN_SCHED_RR && new_policy != GREEN_SCHED_MLFQ && new_policy != GREEN_SCHED_FAIR)
+        return -1;
+
+    lock();
+    policy = new_policy;
+    boost_ticks = 0;
+    if (!first_call)
+        rq_rebuild();
+    unlock();
+    return 0;
+}
+
+int pthread_setschedprio(pthread_t thread, int prio)
+{
+    if (prio < 0 || prio > MLFQ_LEVELS)
+        return EINVAL;
+    if (thread >= MAX_THREADS)
+        return ESRCH;
+
+    lock();
+    // 0 hands the thread back to MLFQ, 1..MLFQ_LEVELS pin it with MLFQ_LEVELS the highest
+    TCB[thread].pinned = prio > 0;
+    TCB[thread].level = prio > 0 ? MLFQ_LEVELS - prio : 0;
+    TCB[thread].ticks = 0;
+
+    // Move it to its new level if it is waiting in the run queue
+    if (TCB[thread].status == READY)
+    {
+        rq_remove(thread);
+        rq_push(thread);
+    }
+    unlock();
+    return 0;
+}
+
+int green_set_weight(pthread_t thread, unsigned int weight)
+{
+    if (weight == 0 || thread >= MAX_THREADS)
+        return -1;
+
+    lock();
+    // Settle the running thread at its old weight first
+    if (thread == curr_TID && !first_call)
+        account(curr_TID);
+    TCB[thread].weight = weight;
+    unlock();
+    return 0;
+}
+
+unsigned long long green_get_runtime(pthread_t thread)
+{
+    if (thread >= MAX_THREADS)
+        return 0;
+
+    lock();
+    if (thread == curr_TID && !first_call)
+        account(curr_TID);
+    unsigned long long runtime = TCB[thread].runtime;
+    unlock();
+    return runtime;
+}
+
+int green_set_edf(pthread_t thread, unsigned long period_us, unsigned long budget_us, unsigned long deadline_us)
+{
+    if (thread >= MAX_THREADS || budget_us == 0 || deadline_us == 0 ||
+        budget_us > deadline_us || deadline_us > period_us)
+        return -1;
+
+    lock();
+    if (TCB[thread].status == FRESH || TCB[thread].status == WAITING || TCB[thread].status == EXITED)
+    {
+        unlock();
+        return -1;
+    }
+
+    // Admission control: EDF meets every deadline as long as the total density stays at or below 1
+    unsigned long density = budget_us * 1000000UL / deadline_us;
+    unsigned long others = edf_density - (TCB[thread].edf ? TCB[thread].edf_density : 0);
+    if (others + density > 1000000UL)
+    {
+        unlock();
+        return -1;
+    }
+
+    // Move it out of the policy's run queue if it is waiting there
+    int queued = TCB[thread].status == READY;
+    if (queued)
+        rq_remove(thread);
+
+    if (!TCB[thread].edf)
+        edf_count++;
+    edf_density = others + density;
+    TCB[thread].edf_density = density;
+    TCB[thread].edf_period = period_us * 1000ULL;
+    TCB[thread].edf_budget = budget_us * 1000ULL;
+    TCB[thread].edf_deadline = deadline_us * 1000ULL;
+
+    // The first job is released now
+    unsigned long long now = now_ns();
+    TCB[thread].edf_release = now + TCB[thread].edf_period;
+    TCB[thread].edf_abs_deadline = now + TCB[thread].edf_deadline;
+    TCB[thread].edf_used = 0;
+    TCB[thread].edf_done = 0;
+    TCB[thread].edf_missed = 0;
+    TCB[thread].edf_waiting = 0;
+    TCB[thread].edf = 1;
+
+    if (queued)
+        rq_push(thread);
+    if (!first_call)
+        tick_arm();
+    unlock();
+    return 0;
+}
+
+void green_edf_wait()
+{
+    lock();
+    if (!TCB[curr_TID].edf)
+    {
+        unlock();
+        return;
+    }
+
+    // Finished the job, count it as missed if it ran past its deadline
+    TCB[curr_TID].edf_done = 1;
+    if (!TCB[curr_TID].edf_missed && now_ns() > TCB[curr_TID].edf_abs_deadline)
+        TCB[curr_TID].edf_misses++;
+
+    TCB[curr_TID].status = BLOCKED;
+    TCB[curr_TID].edf_waiting = 1;
+    scheduler();
+    unlock();
+}
+
+unsigned long green_edf_misses(pthread_t thread)
+{
+    if (thread >= MAX_THREADS)
+        return 0;
+    return TCB[thread].edf_misses;
+}
+
+pthread_t pthread_self()
+{
+    return curr_TID;
+}
+
+void lock()
+{
+    // Nothing can interrupt us without preemption
+    if (!preempt)
+        return;
+
+    // Block any incoming SIGALRMs
+    sigset_t set, oset;
+    sigemptyset(&set);
+    sigaddset(&set, SIGALRM);
+    sigprocmask(SIG_BLOCK, &set, &oset);
+}
+
+void unlock()
+{
+    // Leaving the runtime is a checkpoint, deterministic mode preempts on a count of them like the tick would
+    if (deterministic && det_checkpoints > 0 && --det_left <= 0 && !first_call && TCB[curr_TID].status == RUNNING)
+    {
+        preempting = 1;
+        scheduler();
+    }
+
+    if (!preempt)
+        return;
+
+    // Unblock any incoming SIGALRMS
+    sigset_t set, oset;
+    sigemptyset(&set);
+    sigaddset(&set, SIGALRM);
+    sigprocmask(SIG_UNBLOCK, &set, &oset);
+}
+
+int pthread_join(pthread_t thread, void **value_ptr)
+{
+    if (thread >= MAX_THREADS)
+        return ESRCH;
+
+    lock();
+    TRACE(TRACE_JOIN, curr_TID, thread);
+    // Never created, already joined or detached and gone
+    if (TCB[thread].status == FRESH || TCB[thread].status == EXITED)
+    {
+        unlock();
+        return ESRCH;
+    }
+    if (TCB[thread].detached || thread == curr_TID)
+    {
+        unlock();
+        return thread == curr_TID ? EDEADLK : EINVAL;
+    }
+
+    // Block until the thread exits, pthread_exit puts us back on the run queue
+    if (TCB[thread].status != WAITING)
+    {
+        // printf("thread %d joining thread %d\n", (unsigned int)curr_TID, (unsigned int)thread);
+        // The result of multiple calls to the same target is undefined
+        TCB[thread].joining = curr_TID;
+        TCB[curr_TID].status = BLOCKED;
+        mlfq_blocked(curr_TID);
+        scheduler();
+    }
+
+    if (value_ptr != NULL)
+    {
+        // copy the value from exit to the local return ptr
+        *value_ptr = (void *)TCB[thread].exitcode;
+    }
+
+    // The thread is gone, free its stack from here rather than from the stack itself
+    // and let pthread_create have the slot again
+    TCB[thread].status = EXITED;
+    if (thread != 0)
+    {
+        stack_free(thread);
+        slot_release(thread);
+    }
+    total_threads--;
+
+    unlock();
+    // On Success
+    return 0;
+}
+
+static int futex(int *addr, int op, int val, const struct timespec *timeout)
+{
+    return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
+
+static psheminfo *pshared_sem(sem_t *sem)
+{
+    psheminfo *ps = (psheminfo *)sem;
+    return ps->tag == PSHARED_SEM_TAG ? ps : NULL;
+}
+
+// Take a process-shared semaphore, expiry is a now_ns() deadline or 0 to wait forever
+static int pshared_wait(psheminfo *ps, unsigned long long expiry)
+{
+    while (1)
+    {
+        int v = __atomic_load_n(&ps->val, __ATOMIC_RELAXED);
+        while (v > 0)
+        {
+            if (__atomic_compare_exchange_n(&ps->val, &v, v - 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                return 0;
+        }
+
+        // The other green threads of this process get the CPU before we put all of them to sleep
+        if (rq_len > 0)
+        {
+            pthread_yield();
+            continue;
+        }
+
+        long long left = -1;
+        if (expiry)
+        {
+            left = (long long)(expiry - now_ns());
+            if (left <= 0)
             {
-                pthread_t next_run = temp->waiting[i];
-                temp->waiting[i] = 0;
-                TCB[next_run].status = RUNNING;
-                longjmp(TCB[next_run].reg, 1);
+                errno = ETIMEDOUT;
+                return -1;
             }
         }
-        else if (temp->val > 0)
+        // Sleeping threads and I/O only move when the scheduler runs, so wake up to let it
+        if (timers_pending > 0 || io_waiters > 0 || sig_waiters > 0)
+            left = left < 0 || left > PSHARED_SLEEP_NS ? PSHARED_SLEEP_NS : left;
+        struct timespec rel = {left / 1000000000LL, left % 1000000000LL};
+
+        // A post between our load and here changes val and FUTEX_WAIT returns at once
+        __atomic_fetch_add(&ps->waiters, 1, __ATOMIC_SEQ_CST);
+        futex(&ps->val, FUTEX_WAIT, 0, left < 0 ? NULL : &rel);
+        __atomic_fetch_sub(&ps->waiters, 1, __ATOMIC_SEQ_CST);
+        pthread_yield();
+    }
+}
+
+int sem_init(sem_t *sem, int pshared, unsigned value)
+{
+    // State lives in the sem_t itself so every process mapping it sees the same semaphore
+    if (pshared)
+    {
+        psheminfo *ps = (psheminfo *)sem;
+        ps->val = value;
+        ps->waiters = 0;
+        ps->tag = PSHARED_SEM_TAG;
+        return 0;
+    }
+
+    seminfo *SEB = malloc(sizeof(*SEB));
+    SEB->val = value;
+    SEB->status = INITIALIZED;
+    SEB->handoff = 0;
+    SEB->waiting.head = NULL;
+    SEB->waiting.tail = NULL;
+
+    sem->__align = (long int)SEB;
+    return 0;
+}
+
+int sem_wait(sem_t *sem)
+{
+    seminfo *temp = (seminfo *)sem->__align;
+    psheminfo *ps = pshared_sem(sem);
+
+    if (ps != NULL)
+    {
+        unsigned long long start = now_ns();
+        pshared_wait(ps, 0);
+        TCB[curr_TID].sem_wait_ns += now_ns() - start;
+        return 0;
+    }
+
+    lock();
+    TRACE(TRACE_SEM_WAIT, curr_TID, sem);
+    if (temp->status == INITIALIZED)
+    {
+        if (temp->val <= 0)
+        {
+            // sem_post hands its increment straight to us, so there is nothing to decrement after waking
+            runtime_start();
+            unsigned long long start = now_ns();
+            block_on(&temp->waiting);
+            TCB[curr_TID].sem_wait_ns += now_ns() - start;
+        }
+        else if (temp->val > 0)
+        {
+            temp->val--;
+        }
+    }
+    else
+    {
+        unlock();
+        printf("ERROR: This semaphore is destroyed\n");
+        return -1;
+    }
+    unlock();
+    return 0;
+}
+
+int sem_timedwait(sem_t *sem, const struct timespec *abstime)
+{
+    seminfo *temp = (seminfo *)sem->__align;
+    psheminfo *ps = pshared_sem(sem);
+
+    if (ps != NULL)
+    {
+        unsigned long long start = now_ns();
+        int ret = pshared_wait(ps, abs_to_expiry(abstime));
+        TCB[curr_TID].sem_wait_ns += now_ns() - start;
+        return ret;
+    }
+
+    lock();
+    TRACE(TRACE_SEM_WAIT, curr_TID, sem);
+    if (temp->status != INITIALIZED)
+    {
+        unlock();
+        printf("ERROR: This semaphore is destroyed\n");
+        return -1;
+    }
+
+    if (temp->val > 0)
+        temp->val--;
+    else
+    {
+        // If sem_post picked us before the timer fired we own the increment, otherwise we were taken off the queue
+        runtime_start();
+        unsigned long long start = now_ns();
+        int timed_out = block_on_timed(&temp->waiting, abs_to_expiry(abstime));
+        TCB[curr_TID].sem_wait_ns += now_ns() - start;
+        if (timed_out)
+        {
+            unlock();
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+    unlock();
+    return 0;
+}
+
+int sem_post(sem_t *sem)
+{
+    seminfo *temp = (seminfo *)sem->__align;
+    psheminfo *ps = pshared_sem(sem);
+
+    // Only go to the kernel when some process is asleep on it
+    if (ps != NULL)
+    {
+        __atomic_fetch_add(&ps->val, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ps->waiters, __ATOMIC_SEQ_CST) > 0)
+            futex(&ps->val, FUTEX_WAKE, 1, NULL);
+        return 0;
+    }
+
+    lock();
+    TRACE(TRACE_SEM_POST, curr_TID, sem);
+    if (temp->status == INITIALIZED)
+    {
+        // Wake the longest waiting thread, or increment the semaphore value if nobody is waiting
+        pthread_t next_run = wake_one(&temp->waiting);
+        if (next_run == NO_THREAD)
+        {
+            temp->val++;
+        }
+        // With direct handoff we give the woken thread the rest of our slice
+        else if (temp->handoff)
+        {
+            handoff_to = next_run;
+            scheduler();
+        }
+    }
+    else
+    {
+        unlock();
+        printf("ERROR: This semaphore is destroyed\n");
+        return -1;
+    }
+
+    unlock();
+    return 0;
+}
+
+int sem_destroy(sem_t *sem)
+{
+    seminfo *temp = (seminfo *)sem->__align;
+    psheminfo *ps = pshared_sem(sem);
+
+    if (ps != NULL)
+    {
+        ps->tag = 0;
+        return 0;
+    }
+
+    if (temp->status == INITIALIZED)
+    {
+        temp->status = DESTROYED;
+        free(temp);
+    }
+    return 0;
+}
+
+int green_sem_handoff(sem_t *sem, int on)
+{
+    seminfo *temp = (seminfo *)sem->__align;
+
+    // There is no thread of ours to hand a process-shared semaphore to
+    if (pshared_sem(sem) != NULL)
+        return -1;
+
+    if (temp->status != INITIALIZED)
+        return -1;
+    temp->handoff = on;
+    return 0;
+}
+
+static waitqueue *wait_bucket(int *addr)
+{
+    return &wait_table[(((unsigned long int)addr >> 2) * 2654435761UL) % WAIT_BUCKETS];
+}
+
+int green_wait(int *addr, int expected)
+{
+    lock();
+    // The value changed before we got here, the caller should look again
+    if (__atomic_load_n(addr, __ATOMIC_ACQUIRE) != expected)
+    {
+        unlock();
+        return -1;
+    }
+
+    runtime_start();
+    waiter w;
+    w.addr = addr;
+    wait_prepare(wait_bucket(addr), &w);
+    scheduler();
+    unlock();
+    return 0;
+}
+
+int green_wake(int *addr, int n)
+{
+    waitqueue *wq = wait_bucket(addr);
+
+    // Nobody parked in this bucket, no syscall
+    if (wq->head == NULL)
+        return 0;
+
+    lock();
+    int woken = 0;
+    waiter *w = wq->head;
+    while (w != NULL && woken < n)
+    {
+        waiter *next = w->next;
+        if (w->addr == addr)
+        {
+            wq_remove(w);
+            make_ready(w->tid);
+            woken++;
+        }
+        w = next;
+    }
+    unlock();
+    return woken;
+}
+
+ssize_t green_read(int fd, void *buf, size_t count)
+{
+    if (io_nonblock(fd) < 0)
+        return -1;
+
+    while (1)
+    {
+        ssize_t n = read(fd, buf, count);
+        if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            return n;
+        lock();
+        runtime_start();
+        if (io_park(fd, EPOLLIN) < 0)
+        {
+            unlock();
+            return -1;
+        }
+        unlock();
+    }
+}
+
+ssize_t green_write(int fd, const void *buf, size_t count)
+{
+    if (io_nonblock(fd) < 0)
+        return -1;
+
+    while (1)
+    {
+        ssize_t n = write(fd, buf, count);
+        if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            return n;
+        lock();
+        runtime_start();
+        if (io_park(fd, EPOLLOUT) < 0)
+        {
+            unlock();
+            return -1;
+        }
+        unlock();
+    }
+}
+
+int green_accept(int fd, struct sockaddr *addr, socklen_t *addrlen)
+{
+    if (io_nonblock(fd) < 0)
+        return -1;
+
+    while (1)
+    {
+        int conn = accept(fd, addr, addrlen);
+        if (conn >= 0)
+        {
+            // The new connection is non-blocking from the start
+            io_nonblock(conn);
+            return conn;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return conn;
+        lock();
+        runtime_start();
+        if (io_park(fd, EPOLLIN) < 0)
+        {
+            unlock();
+            return -1;
+        }
+        unlock();
+    }
+}
+
+/*
+    Mutexes, condition variables, read-write locks and barriers keep their state inside the
+    pthread types. The uncontended paths are a single atomic on that state: preemption is a
+    signal on this same kernel thread, so an atomic instruction cannot be split by it and no
+    lock() is needed. Only the slow paths mask SIGALRM and touch the wait queues.
+*/
+_Static_assert(sizeof(mutexinfo) <= sizeof(pthread_mutex_t), "mutexinfo does not fit in pthread_mutex_t");
+_Static_assert(sizeof(condinfo) <= sizeof(pthread_cond_t), "condinfo does not fit in pthread_cond_t");
+_Static_assert(sizeof(rwlockinfo) <= sizeof(pthread_rwlock_t), "rwlockinfo does not fit in pthread_rwlock_t");
+_Static_assert(sizeof(barrierinfo) <= sizeof(pthread_barrier_t), "barrierinfo does not fit in pthread_barrier_t");
+
+// Take the mutex, blocking until it is free (SIGALRM blocked)
+static void mutex_acquire(mutexinfo *m)
+{
+    // 2 tells the owner that someone may be waiting and it has to wake them on unlock
+    while (__atomic_exchange_n(&m->state, 2, __ATOMIC_ACQUIRE) != 0)
+        block_on(&m->waiting);
+    m->owner = curr_TID;
+}
+
+// Free the mutex and wake the next waiter if there might be one (SIGALRM blocked)
+static void mutex_release(mutexinfo *m)
+{
+    // Cleared first, the next owner only sets it after its exchange and must not look like us meanwhile
+    m->owner = NO_THREAD;
+    if (__atomic_exchange_n(&m->state, 0, __ATOMIC_RELEASE) == 2)
+        wake_one(&m->waiting);
+}
+
+int pthread_mutex_init(pthread_mutex_t *mutex, const pthread_mutexattr_t *attr)
+{
+    mutexinfo *m = (mutexinfo *)mutex;
+    memset(mutex, 0, sizeof(*mutex));
+
+    int type = PTHREAD_MUTEX_NORMAL;
+    if (attr != NULL)
+        pthread_mutexattr_gettype(attr, &type);
+    m->type = type;
+    // Not 0, that is main's tid
+    m->owner = NO_THREAD;
+    return 0;
+}
+
+int pthread_mutex_destroy(pthread_mutex_t *mutex)
+{
+    mutexinfo *m = (mutexinfo *)mutex;
+    if (m->state != 0 || m->waiting.head != NULL)
+        return EBUSY;
+    return 0;
+}
+
+int pthread_mutex_lock(pthread_mutex_t *mutex)
+{
+    mutexinfo *m = (mutexinfo *)mutex;
+
+    if (m->type != PTHREAD_MUTEX_NORMAL && m->state != 0 && m->owner == curr_TID)
+    {
+        if (m->type == PTHREAD_MUTEX_ERRORCHECK)
+            return EDEADLK;
+        m->count++;
+        return 0;
+    }
+
+    // Uncontended, no syscall and no switch
+    int expected = 0;
+    if (__atomic_compare_exchange_n(&m->state, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+        m->owner = curr_TID;
+        m->count = 1;
+        return 0;
+    }
+
+    lock();
+    runtime_start();
+    mutex_acquire(m);
+    m->count = 1;
+    unlock();
+    return 0;
+}
+
+int pthread_mutex_trylock(pthread_mutex_t *mutex)
+{
+    mutexinfo *m = (mutexinfo *)mutex;
+
+    if (m->type == PTHREAD_MUTEX_RECURSIVE && m->state != 0 && m->owner == curr_TID)
+    {
+        m->count++;
+        return 0;
+    }
+
+    int expected = 0;
+    if (!__atomic_compare_exchange_n(&m->state, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return EBUSY;
+    m->owner = curr_TID;
+    m->count = 1;
+    return 0;
+}
+
+int pthread_mutex_unlock(pthread_mutex_t *mutex)
+{
+    mutexinfo *m = (mutexinfo *)mutex;
+
+    if (m->type != PTHREAD_MUTEX_NORMAL)
+    {
+        if (m->state == 0 || m->owner != curr_TID)
+            return EPERM;
+        if (--m->count > 0)
+            return 0;
+    }
+
+    // A thread that takes the lock next and is preempted before setting owner must not leave us as the owner
+    m->owner = NO_THREAD;
+    // Nobody was waiting, nothing else to do
+    if (__atomic_exchange_n(&m->state, 0, __ATOMIC_RELEASE) == 1)
+        return 0;
+
+    lock();
+    wake_one(&m->waiting);
+    unlock();
+    return 0;
+}
+
+int pthread_cond_init(pthread_cond_t *cond, const pthread_condattr_t *attr)
+{
+    memset(cond, 0, sizeof(*cond));
+    return 0;
+}
+
+int pthread_cond_destroy(pthread_cond_t *cond)
+{
+    condinfo *c = (condinfo *)cond;
+    if (c->waiting.head != NULL)
+        return EBUSY;
+    return 0;
+}
+
+int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex)
+{
+    condinfo *c = (condinfo *)cond;
+    mutexinfo *m = (mutexinfo *)mutex;
+
+    // Queue up before letting go of the mutex so a signal in between cannot be missed
+    lock();
+    runtime_start();
+    waiter w;
+    wait_prepare(&c->waiting, &w);
+    int count = m->count;
+    mutex_release(m);
+    scheduler();
+
+    mutex_acquire(m);
+    m->count = count;
+    unlock();
+    return 0;
+}
+
+int pthread_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex, const struct timespec *abstime)
+{
+    condinfo *c = (condinfo *)cond;
+    mutexinfo *m = (mutexinfo *)mutex;
+
+    lock();
+    runtime_start();
+    waiter w;
+    wait_prepare(&c->waiting, &w);
+    int count = m->count;
+    mutex_release(m);
+    int timed_out = wait_timed(abs_to_expiry(abstime));
+
+    mutex_acquire(m);
+    m->count = count;
+    unlock();
+    return timed_out ? ETIMEDOUT : 0;
+}
+
+int pthread_cond_signal(pthread_cond_t *cond)
+{
+    condinfo *c = (condinfo *)cond;
+
+    // Nobody waiting, no syscall
+    if (c->waiting.head == NULL)
+        return 0;
+
+    lock();
+    wake_one(&c->waiting);
+    unlock();
+    return 0;
+}
+
+int pthread_cond_broadcast(pthread_cond_t *cond)
+{
+    condinfo *c = (condinfo *)cond;
+
+    if (c->waiting.head == NULL)
+        return 0;
+
+    lock();
+    wake_all(&c->waiting);
+    unlock();
+    return 0;
+}
+
+int pthread_rwlock_init(pthread_rwlock_t *rwlock, const pthread_rwlockattr_t *attr)
+{
+    memset(rwlock, 0, sizeof(*rwlock));
+    return 0;
+}
+
+int pthread_rwlock_destroy(pthread_rwlock_t *rwlock)
+{
+    rwlockinfo *rw = (rwlockinfo *)rwlock;
+    if (rw->state != 0 || rw->readers.head != NULL || rw->writers.head != NULL)
+        return EBUSY;
+    return 0;
+}
+
+// Readers get in while there is no writer holding or waiting for the lock, so writers cannot starve
+static int rwlock_tryread(rwlockinfo *rw)
+{
+    int state = __atomic_load_n(&rw->state, __ATOMIC_RELAXED);
+    while (state >= 0 && rw->writers.head == NULL)
+    {
+        if (__atomic_compare_exchange_n(&rw->state, &state, state + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return 1;
+    }
+    return 0;
+}
+
+static int rwlock_trywrite(rwlockinfo *rw)
+{
+    int expected = 0;
+    return __atomic_compare_exchange_n(&rw->state, &expected, -1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+int pthread_rwlock_rdlock(pthread_rwlock_t *rwlock)
+{
+    rwlockinfo *rw = (rwlockinfo *)rwlock;
+
+    if (rwlock_tryread(rw))
+        return 0;
+
+    lock();
+    runtime_start();
+    while (!rwlock_tryread(rw))
+        block_on(&rw->readers);
+    unlock();
+    return 0;
+}
+
+int pthread_rwlock_tryrdlock(pthread_rwlock_t *rwlock)
+{
+    return rwlock_tryread((rwlockinfo *)rwlock) ? 0 : EBUSY;
+}
+
+int pthread_rwlock_wrlock(pthread_rwlock_t *rwlock)
+{
+    rwlockinfo *rw = (rwlockinfo *)rwlock;
+
+    if (rwlock_trywrite(rw))
+        return 0;
+
+    lock();
+    runtime_start();
+    while (!rwlock_trywrite(rw))
+        block_on(&rw->writers);
+    unlock();
+    return 0;
+}
+
+int pthread_rwlock_trywrlock(pthread_rwlock_t *rwlock)
+{
+    return rwlock_trywrite((rwlockinfo *)rwlock) ? 0 : EBUSY;
+}
+
+int pthread_rwlock_unlock(pthread_rwlock_t *rwlock)
+{
+    rwlockinfo *rw = (rwlockinfo *)rwlock;
+
+    // A writer leaves the lock free, a reader just drops the count
+    int state;
+    if (__atomic_load_n(&rw->state, __ATOMIC_RELAXED) == -1)
+    {
+        __atomic_store_n(&rw->state, 0, __ATOMIC_RELEASE);
+        state = 0;
+    }
+    else
+        state = __atomic_sub_fetch(&rw->state, 1, __ATOMIC_RELEASE);
+
+    // Nobody to hand the lock to, no syscall
+    if (state != 0 || (rw->writers.head == NULL && rw->readers.head == NULL))
+        return 0;
+
+    // Writers first, the readers go once no writer is left waiting
+    lock();
+    if (wake_one(&rw->writers) == NO_THREAD)
+        wake_all(&rw->readers);
+    unlock();
+    return 0;
+}
+
+int pthread_barrier_init(pthread_barrier_t *barrier, const pthread_barrierattr_t *attr, unsigned count)
+{
+    barrierinfo *b = (barrierinfo *)barrier;
+
+    if (count == 0)
+        return EINVAL;
+    memset(barrier, 0, sizeof(*barrier));
+    b->target = count;
+    return 0;
+}
+
+int pthread_barrier_destroy(pthread_barrier_t *barrier)
+{
+    barrierinfo *b = (barrierinfo *)barrier;
+    if (b->waiting.head != NULL)
+        return EBUSY;
+    return 0;
+}
+
+int pthread_barrier_wait(pthread_barrier_t *barrier)
+{
+    barrierinfo *b = (barrierinfo *)barrier;
+
+    lock();
+    // Everyone but the last thread waits, the last one releases them all and starts a new round
+    if (++b->count < b->target)
+    {
+        runtime_start();
+        block_on(&b->waiting);
+        unlock();
+        return 0;
+    }
+
+    b->count = 0;
+    wake_all(&b->waiting);
+    unlock();
+    return PTHREAD_BARRIER_SERIAL_THREAD;
+}
+
+chan *chan_make(unsigned cap, size_t elem_size)
+{
+    chan *ch = calloc(1, sizeof(chan));
+    if (ch == NULL)
+        return NULL;
+    ch->cap = cap;
+    ch->elem_size = elem_size;
+    // One spare byte so a channel of empty values still gets a buffer
+    if (cap > 0 && (ch->buf = malloc(cap * elem_size + 1)) == NULL)
+    {
+        free(ch);
+        return NULL;
+    }
+    return ch;
+}
+
+// Take the longest waiting thread whose chan_select has not been fired by another channel, NULL if none
+static chanwaiter *chan_pop(waitqueue *wq)
+{
+    waiter *w;
+    while ((w = wq_pop(wq)) != NULL)
+    {
+        chanwaiter *cw = (chanwaiter *)w;
+        if (*cw->fired < 0)
+        {
+            *cw->fired = cw->index;
+            return cw;
+        }
+    }
+    return NULL;
+}
+
+// Send without blocking: 1 if a receiver or the buffer took the value, 0 if it would block, -1 if closed
+static int chan_try_send(chan *ch, const void *elem)
+{
+    if (ch->closed)
+        return -1;
+
+    // A receiver is already waiting, copy straight into it and skip the buffer
+    chanwaiter *r = chan_pop(&ch->receivers);
+    if (r != NULL)
+    {
+        if (r->elem != NULL)
+            memcpy(r->elem, elem, ch->elem_size);
+        r->ok = 1;
+        make_ready(r->w.tid);
+        return 1;
+    }
+
+    if (ch->len < ch->cap)
+    {
+        memcpy(ch->buf + (ch->head + ch->len) % ch->cap * ch->elem_size, elem, ch->elem_size);
+        ch->len++;
+        return 1;
+    }
+    return 0;
+}
+
+// Receive without blocking: 1 if a value came out, 0 if it would block, -1 if closed and drained
+static int chan_try_recv(chan *ch, void *elem)
+{
+    chanwaiter *s;
+    if (ch->len > 0)
+    {
+        if (elem != NULL)
+            memcpy(elem, ch->buf + ch->head * ch->elem_size, ch->elem_size);
+        ch->head = (ch->head + 1) % ch->cap;
+        ch->len--;
+
+        // That made room, the longest waiting sender's value moves into the buffer
+        if ((s = chan_pop(&ch->senders)) != NULL)
         {
-            temp->val++;
+            memcpy(ch->buf + (ch->head + ch->len) % ch->cap * ch->elem_size, s->elem, ch->elem_size);
+            ch->len++;
+            s->ok = 1;
+            make_ready(s->w.tid);
         }
+        return 1;
     }
-    else
+
+    // Unbuffered, or a sender got here first: take the value from its stack
+    if ((s = chan_pop(&ch->senders)) != NULL)
     {
-        printf("ERROR: This semaphore is destroyed\n");
+        if (elem != NULL)
+            memcpy(elem, s->elem, ch->elem_size);
+        s->ok = 1;
+        make_ready(s->w.tid);
+        return 1;
+    }
+
+    if (ch->closed)
+    {
+        if (elem != NULL)
+            memset(elem, 0, ch->elem_size);
+        return -1;
+    }
+    return 0;
+}
+
+int chan_send(chan *ch, const void *elem)
+{
+    lock();
+    int r = chan_try_send(ch, elem);
+    if (r == 0)
+    {
+        // Nowhere to put it, wait for a receiver to take the value from our stack
+        int fired = -1;
+        chanwaiter cw;
+        runtime_start();
+        cw.elem = (void *)elem;
+        cw.fired = &fired;
+        cw.index = 0;
+        cw.ok = 0;
+        wait_prepare(&ch->senders, &cw.w);
+        scheduler();
+        r = cw.ok ? 1 : -1;
+    }
+    unlock();
+    return r < 0 ? -1 : 0;
+}
+
+int chan_recv(chan *ch, void *elem)
+{
+    lock();
+    int r = chan_try_recv(ch, elem);
+    if (r == 0)
+    {
+        // Nothing there, a sender copies its value straight into elem
+        int fired = -1;
+        chanwaiter cw;
+        runtime_start();
+        cw.elem = elem;
+        cw.fired = &fired;
+        cw.index = 0;
+        cw.ok = 0;
+        wait_prepare(&ch->receivers, &cw.w);
+        scheduler();
+        r = cw.ok ? 1 : -1;
+    }
+    unlock();
+    return r < 0 ? -1 : 0;
+}
+
+int chan_select(chan_case *cases, int n, int block)
+{
+    lock();
+    // Take the first case that can go right away
+    int i = 0;
+    for (i = 0; i < n; i++)
+    {
+        int r = cases[i].send ? chan_try_send(cases[i].ch, cases[i].elem) : chan_try_recv(cases[i].ch, cases[i].elem);
+        if (r != 0)
+        {
+            cases[i].ok = r > 0;
+            unlock();
+            return i;
+        }
+    }
+    if (!block || n == 0)
+    {
+        unlock();
+        return -1;
+    }
+
+    // Wait on every channel at once, whichever fires first claims the select for its case
+    runtime_start();
+    int fired = -1;
+    chanwaiter cw[n];
+    for (i = 0; i < n; i++)
+    {
+        cw[i].elem = cases[i].elem;
+        cw[i].fired = &fired;
+        cw[i].index = i;
+        cw[i].ok = 0;
+        waitqueue *wq = cases[i].send ? &cases[i].ch->senders : &cases[i].ch->receivers;
+        if (i == 0)
+            wait_prepare(wq, &cw[i].w);
+        else
+        {
+            cw[i].w.tid = curr_TID;
+            wq_push(wq, &cw[i].w);
+        }
+    }
+    scheduler();
+
+    // The other cases are still queued on their channels
+    for (i = 0; i < n; i++)
+    {
+        if (cw[i].w.queue != NULL)
+            wq_remove(&cw[i].w);
+    }
+    cases[fired].ok = cw[fired].ok;
+    unlock();
+    return fired;
+}
+
+int chan_close(chan *ch)
+{
+    lock();
+    if (ch->closed)
+    {
+        unlock();
         return -1;
     }
+    ch->closed = 1;
 
+    // Receivers get a zeroed value and senders an error, buffered values can still be received
+    chanwaiter *cw;
+    while ((cw = chan_pop(&ch->receivers)) != NULL)
+    {
+        if (cw->elem != NULL)
+            memset(cw->elem, 0, ch->elem_size);
+        make_ready(cw->w.tid);
+    }
+    while ((cw = chan_pop(&ch->senders)) != NULL)
+        make_ready(cw->w.tid);
+    unlock();
     return 0;
 }
 
-int sem_destroy(sem_t *sem)
+void chan_destroy(chan *ch)
 {
-    seminfo *temp = (seminfo *)sem->__align;
+    free(ch->buf);
+    free(ch);
+}
 
-    if (temp->status == INITIALIZED)
+// Take the newest task off our own deque, 0 if it is empty or a thief got the last one
+static int deque_take(taskdeque *d, task *t)
+{
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long top = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+
+    if (top > b)
     {
-        temp->status = DESTROYED;
-        free(temp);
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    *t = d->tasks[b % TASK_DEQUE_SIZE];
+    if (top == b)
+    {
+        // Last one, race the thieves for it
+        int won = __atomic_compare_exchange_n(&d->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+        return won;
+    }
+    return 1;
+}
+
+// Take the oldest task off someone else's deque, 0 if there was nothing or another thief won
+static int deque_steal(taskdeque *d, task *t)
+{
+    long top = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+
+    if (top >= b)
+        return 0;
+    *t = d->tasks[top % TASK_DEQUE_SIZE];
+    return __atomic_compare_exchange_n(&d->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+// The calling thread's deque, handing it one the first time, NULL once they have all been handed out
+static taskdeque *task_deque()
+{
+    int idx = TCB[curr_TID].task_deque;
+    if (idx > 0)
+        return task_deques[idx - 1];
+
+    lock();
+    taskdeque *d = NULL;
+    if (task_nfree > 0)
+    {
+        TCB[curr_TID].task_deque = task_free_deques[--task_nfree];
+        d = task_deques[TCB[curr_TID].task_deque - 1];
+    }
+    else if (task_ndeques < TASK_DEQUES && (d = calloc(1, sizeof(taskdeque))) != NULL)
+    {
+        task_deques[task_ndeques] = d;
+        __atomic_store_n(&task_ndeques, task_ndeques + 1, __ATOMIC_RELEASE);
+        TCB[curr_TID].task_deque = task_ndeques;
+    }
+    unlock();
+    return d;
+}
+
+// Run a task and tell its group, waking task_sync if it was the last one
+static void task_run(task *t)
+{
+    t->fn(t->arg);
+    if (__atomic_sub_fetch(&t->group->pending, 1, __ATOMIC_SEQ_CST) == 0 &&
+        __atomic_load_n(&t->group->sleeping, __ATOMIC_SEQ_CST))
+    {
+        lock();
+        wake_all(&t->group->waiting);
+        unlock();
+    }
+}
+
+// Find a task: our own newest first, then the oldest of each other deque in turn
+static int task_find(taskdeque *own, task *t)
+{
+    if (own != NULL && deque_take(own, t))
+        return 1;
+
+    int n = __atomic_load_n(&task_ndeques, __ATOMIC_ACQUIRE);
+    int start = TCB[curr_TID].task_deque;
+    int i = 0;
+    for (i = 0; i < n; i++)
+    {
+        taskdeque *victim = task_deques[(start + i) % n];
+        if (victim != own && deque_steal(victim, t))
+            return 1;
+    }
+    return 0;
+}
+
+// Is there anything left to steal anywhere (SIGALRM blocked)
+static int task_any()
+{
+    int i = 0;
+    for (i = 0; i < task_ndeques; i++)
+    {
+        if (__atomic_load_n(&task_deques[i]->top, __ATOMIC_SEQ_CST) < __atomic_load_n(&task_deques[i]->bottom, __ATOMIC_SEQ_CST))
+            return 1;
+    }
+    return 0;
+}
+
+static void *task_worker(void *arg)
+{
+    taskdeque *own = task_deque();
+    task t;
+    while (1)
+    {
+        if (task_find(own, &t))
+        {
+            task_run(&t);
+            continue;
+        }
+
+        // Nothing anywhere, park until task_spawn has something (it checks task_idle after pushing)
+        lock();
+        if (task_stopping)
+        {
+            unlock();
+            return NULL;
+        }
+        task_idle++;
+        if (!task_any())
+            block_on(&task_idlers);
+        else
+            task_idle--;
+        unlock();
+    }
+}
+
+int task_pool_init(int workers)
+{
+    if (workers <= 0 || task_nworkers > 0)
+        return -1;
+
+    int i = 0;
+    for (i = 0; i < workers && i < TASK_DEQUES; i++)
+    {
+        if (pthread_create(&task_workers[i], NULL, task_worker, NULL) != 0)
+            break;
+        task_nworkers++;
+    }
+    return task_nworkers > 0 ? 0 : -1;
+}
+
+void task_pool_shutdown()
+{
+    lock();
+    task_stopping = 1;
+    task_idle -= wake_count(&task_idlers);
+    unlock();
+
+    int i = 0;
+    for (i = 0; i < task_nworkers; i++)
+        pthread_join(task_workers[i], NULL);
+    task_nworkers = 0;
+    task_stopping = 0;
+}
+
+void task_spawn(task_group *g, void (*fn)(void *), void *arg)
+{
+    if (task_nworkers == 0)
+        task_pool_init(TASK_WORKERS);
+
+    task t;
+    t.fn = fn;
+    t.arg = arg;
+    t.group = g;
+    __atomic_add_fetch(&g->pending, 1, __ATOMIC_SEQ_CST);
+
+    // Push onto our own deque where an idle worker can steal it, no locking on this path
+    taskdeque *d = task_deque();
+    long b = d == NULL ? 0 : __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    if (d == NULL || b - __atomic_load_n(&d->top, __ATOMIC_ACQUIRE) >= TASK_DEQUE_SIZE)
+    {
+        // No room, just run it now
+        task_run(&t);
+        return;
+    }
+    d->tasks[b % TASK_DEQUE_SIZE] = t;
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&task_idle, __ATOMIC_SEQ_CST) > 0)
+    {
+        lock();
+        if (wake_one(&task_idlers) != NO_THREAD)
+            task_idle--;
+        unlock();
+    }
+}
+
+void task_sync(task_group *g)
+{
+    taskdeque *own = task_deque();
+    task t;
+    while (__atomic_load_n(&g->pending, __ATOMIC_SEQ_CST) > 0)
+    {
+        // Help out rather than wait, starting with the children we just spawned
+        if (task_find(own, &t))
+        {
+            task_run(&t);
+            continue;
+        }
+
+        // The rest are running (or preempted) on other workers, sleep until the last one finishes
+        lock();
+        __atomic_store_n(&g->sleeping, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&g->pending, __ATOMIC_SEQ_CST) > 0)
+            block_on(&g->waiting);
+        unlock();
+    }
+}
+
+// One piece of a parallel_for, split in half until it is down to grain
+typedef struct
+{
+    long lo;
+    long hi;
+    long grain;
+    void (*body)(long, long, void *);
+    void *arg;
+} pfor_range;
+
+static void pfor_run(void *p)
+{
+    pfor_range *r = p;
+    if (r->hi - r->lo <= r->grain)
+    {
+        r->body(r->lo, r->hi, r->arg);
+        return;
+    }
+
+    // The right half is up for stealing while we carry on with the left
+    long mid = r->lo + (r->hi - r->lo) / 2;
+    pfor_range right = {mid, r->hi, r->grain, r->body, r->arg};
+    pfor_range left = {r->lo, mid, r->grain, r->body, r->arg};
+    task_group g = TASK_GROUP_INITIALIZER;
+    task_spawn(&g, pfor_run, &right);
+    pfor_run(&left);
+    task_sync(&g);
+}
+
+void parallel_for(long begin, long end, long grain, void (*body)(long lo, long hi, void *arg), void *arg)
+{
+    if (grain < 1)
+        grain = 1;
+    pfor_range all = {begin, end, grain, body, arg};
+    if (begin < end)
+        pfor_run(&all);
+}
+
+// First resume lands here on the coroutine's own stack, the last value goes back to coro_resume
+static void coro_start(coro *co)
+{
+    co->value = co->fn(co->arg);
+    co->done = 1;
+    longjmp(co->caller, 1);
+}
+
+coro *coro_create(void *(*fn)(void *), void *arg)
+{
+    coro *co = calloc(1, sizeof(coro));
+    if (co == NULL || (co->stack = malloc(STACK_SIZE)) == NULL)
+    {
+        free(co);
+        return NULL;
     }
+    co->fn = fn;
+    co->arg = arg;
+    // coro_start never returns, it jumps back to whoever resumed it
+    context_init(co->reg, co->stack, (void (*)(long))coro_start, (long)co, NULL);
+    return co;
+}
+
+void *coro_resume(coro *co, void *value)
+{
+    if (co->done)
+        return NULL;
+
+    // Plain setjmp/longjmp, the signal mask and the scheduler are left alone
+    co->value = value;
+    co->resumer = TCB[curr_TID].coro;
+    TCB[curr_TID].coro = co;
+    if (!setjmp(co->caller))
+        longjmp(co->reg, 1);
+    TCB[curr_TID].coro = co->resumer;
+    return co->value;
+}
+
+void *coro_yield(void *value)
+{
+    coro *co = TCB[curr_TID].coro;
+    if (co == NULL)
+        return NULL;
+
+    co->value = value;
+    if (!setjmp(co->reg))
+        longjmp(co->caller, 1);
+    return co->value;
+}
+
+int coro_done(coro *co)
+{
+    return co->done;
+}
+
+void coro_destroy(coro *co)
+{
+    free(co->stack);
+    free(co);
+}
+
+// Long-lived worker: run jobs in submission order, park on the pool while there are none
+static void *pool_worker(void *arg)
+{
+    pool *p = arg;
+
+    lock();
+    while (1)
+    {
+        while (p->head == NULL && !p->stopping)
+            block_on(&p->idle);
+        if (p->head == NULL)
+            break;
+
+        pool_job *job = p->head;
+        p->head = job->next;
+        if (p->head == NULL)
+            p->tail = NULL;
+        unlock();
+
+        job->fn(job->arg);
+
+        // Keep the node for the next pool_submit instead of freeing it
+        lock();
+        job->next = p->spare;
+        p->spare = job;
+        if (--p->pending == 0)
+            wake_all(&p->done);
+    }
+    unlock();
+    return NULL;
+}
+
+pool *pool_create(int n)
+{
+    if (n <= 0)
+        return NULL;
+    pool *p = calloc(1, sizeof(pool));
+    if (p == NULL || (p->workers = malloc(n * sizeof(pthread_t))) == NULL)
+    {
+        free(p);
+        return NULL;
+    }
+
+    for (p->nworkers = 0; p->nworkers < n; p->nworkers++)
+    {
+        if (pthread_create(&p->workers[p->nworkers], NULL, pool_worker, p) != 0)
+            break;
+    }
+    if (p->nworkers == 0)
+    {
+        free(p->workers);
+        free(p);
+        return NULL;
+    }
+    return p;
+}
+
+int pool_submit(pool *p, void (*fn)(void *), void *arg)
+{
+    lock();
+    pool_job *job = p->spare;
+    if (job != NULL)
+        p->spare = job->next;
+    else if ((job = malloc(sizeof(pool_job))) == NULL)
+    {
+        unlock();
+        return -1;
+    }
+
+    job->fn = fn;
+    job->arg = arg;
+    job->next = NULL;
+    if (p->tail == NULL)
+        p->head = job;
+    else
+        p->tail->next = job;
+    p->tail = job;
+    p->pending++;
+
+    // Hand it to a parked worker, busy ones will find it when they are done
+    wake_one(&p->idle);
+    unlock();
     return 0;
-}
\ No newline at end of file
+}
+
+void pool_wait(pool *p)
+{
+    lock();
+    while (p->pending > 0)
+        block_on(&p->done);
+    unlock();
+}
+
+void pool_destroy(pool *p)
+{
+    pool_wait(p);
+
+    lock();
+    p->stopping = 1;
+    wake_all(&p->idle);
+    unlock();
+
+    int i = 0;
+    for (i = 0; i < p->nworkers; i++)
+        pthread_join(p->workers[i], NULL);
+    while (p->spare != NULL)
+    {
+        pool_job *next = p->spare->next;
+        free(p->spare);
+        p->spare = next;
+    }
+    free(p->workers);
+    free(p);
+}
@@ -8,6 +8,7 @@
 #include <setjmp.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <sys/socket.h>
 #include "semaphore.h"
 
 // Manage the status of the thread, 0 = Ready, 1 = Running, 2 = Exited, 3 = New thread
@@ -18,9 +19,13 @@ enum Status
     EXITED,
     WAITING,
     FRESH,
-    BLOCKED
+    BLOCKED,
+    SLEEPING
 };
 
+// Thread-specific data keys, each TCB keeps one value slot per key
+#define GREEN_KEYS 64
+
 // Thread control block needs to have its ID, status, a pointer to its stack and registers
 typedef struct 
 {
@@ -30,34 +35,441 @@ typedef struct
     jmp_buf reg;
     void* exitcode;
     pthread_t joining;
+    // Start routine and its argument, called on the thread's first run
+    void *(*start_routine)(void *);
+    void *arg;
+    // Neighbours on the same run queue level, and that level
+    pthread_t rq_next;
+    pthread_t rq_prev;
+    int rq_level;
+    // MLFQ level (0 is the highest), ticks used at that level, and whether the level is pinned
+    int level;
+    int ticks;
+    int pinned;
+    // Fair policy: share weight, weighted virtual runtime, position in the heap (ns)
+    unsigned int weight;
+    unsigned long long vruntime;
+    int heap_idx;
+    // CPU time used so far and when the thread last got the CPU (ns)
+    unsigned long long runtime;
+    unsigned long long switched_in;
+    // EDF class: period, budget and relative deadline, the current job's window and budget used (ns)
+    int edf;
+    unsigned long long edf_period;
+    unsigned long long edf_budget;
+    unsigned long long edf_deadline;
+    unsigned long edf_density;
+    unsigned long long edf_release;
+    unsigned long long edf_abs_deadline;
+    unsigned long long edf_used;
+    // Job finished, deadline miss already counted, blocked until the next release
+    int edf_done;
+    int edf_missed;
+    int edf_waiting;
+    unsigned long edf_misses;
+    // Wait queue entry while BLOCKED, so a timeout can take the thread off its queue
+    struct waiter *blocked_on;
+    // Timer wheel entry for sleeps and timeouts (expiry in ns), and whether the last wait timed out
+    pthread_t tmr_next;
+    pthread_t tmr_prev;
+    int tmr_slot;
+    int tmr_armed;
+    unsigned long long tmr_expiry;
+    int timed_out;
+    // Index + 1 of the thread's task deque, 0 until it spawns a task
+    int task_deque;
+    // Coroutine the thread is running right now, NULL outside of coroutines
+    struct coro *coro;
+    // Statistics for green_stats_dump: times switched in, switches out by blocking or yielding
+    // and by preemption, and time in ns spent READY, BLOCKED and in sem_wait since state_since
+    unsigned long nr_runs;
+    unsigned long nr_voluntary;
+    unsigned long nr_involuntary;
+    unsigned long long ready_ns;
+    unsigned long long blocked_ns;
+    unsigned long long sem_wait_ns;
+    unsigned long long state_since;
+    // Whether the stack was painted at creation, and its high-water mark in bytes once it exited
+    int stack_painted;
+    long stack_used;
+    // Set by pthread_detach or PTHREAD_CREATE_DETACHED, the thread cleans up after itself on exit
+    int detached;
+    // pthread_setspecific values, indexed by key
+    void *specific[GREEN_KEYS];
 } thread;
 
+// Scheduling policies, round robin, a multilevel feedback queue or weighted fair sharing
+enum greenPolicy
+{
+    GREEN_SCHED_RR,
+    GREEN_SCHED_MLFQ,
+    GREEN_SCHED_FAIR
+};
+
 enum semStatus
 {
     DESTROYED,
     INITIALIZED
 };
 
+// A blocked thread in a wait queue, it lives on that thread's stack while it waits
+typedef struct waiter
+{
+    pthread_t tid;
+    // Address for green_wait, the queue is shared by every address that hashes to it
+    int *addr;
+    struct waiter *next;
+    struct waiter *prev;
+    struct waitqueue *queue;
+} waiter;
+
+// FIFO of blocked threads with O(1) push, pop and removal, all zeroes is an empty queue
+typedef struct waitqueue
+{
+    waiter *head;
+    waiter *tail;
+} waitqueue;
+
 typedef struct
 {
     int val;
-    pthread_t waiting[128];
+    waitqueue waiting;
     enum semStatus status;
+    int handoff;
 } seminfo;
 
+// Kept in the sem_t itself for pshared semaphores, val doubles as the futex word
+typedef struct
+{
+    unsigned long tag;
+    int val;
+    int waiters;
+} psheminfo;
+
+// Threads parked on one file descriptor and the epoll events registered for it
+typedef struct
+{
+    waitqueue readers;
+    waitqueue writers;
+    unsigned int events;
+    int registered;
+} iowait;
+
+// Kept inside pthread_mutex_t, all zeroes is an unlocked PTHREAD_MUTEX_NORMAL mutex
+typedef struct
+{
+    // 0 unlocked, 1 locked, 2 locked and threads may be waiting
+    int state;
+    int type;
+    pthread_t owner;
+    // Lock depth of a recursive mutex
+    int count;
+    waitqueue waiting;
+} mutexinfo;
+
+// Kept inside pthread_cond_t
+typedef struct
+{
+    waitqueue waiting;
+} condinfo;
+
+// Kept inside pthread_rwlock_t
+typedef struct
+{
+    // number of readers holding the lock, -1 while a writer holds it
+    int state;
+    waitqueue readers;
+    waitqueue writers;
+} rwlockinfo;
+
+// Kept inside pthread_barrier_t
+typedef struct
+{
+    unsigned count;
+    unsigned target;
+    waitqueue waiting;
+} barrierinfo;
+
+// Go-style channel carrying elem_size byte values, cap of them buffered (0 for unbuffered)
+typedef struct chan
+{
+    size_t elem_size;
+    unsigned cap;
+    unsigned len;
+    unsigned head;
+    int closed;
+    char *buf;
+    waitqueue senders;
+    waitqueue receivers;
+} chan;
+
+// Thread blocked on a channel, the waiter comes first so it sits on the channel's wait queue
+typedef struct
+{
+    waiter w;
+    // The value to send, or where the received one goes
+    void *elem;
+    // Shared by the cases of one chan_select, the first channel to pick one stores its index here
+    int *fired;
+    int index;
+    // 1 once a value moved, 0 if the channel was closed instead
+    int ok;
+} chanwaiter;
+
+// One case of chan_select
+typedef struct
+{
+    chan *ch;
+    // 1 to send *elem, 0 to receive into elem
+    int send;
+    void *elem;
+    // Set by chan_select, 0 if ch was closed
+    int ok;
+} chan_case;
+
+// Job queued on a thread pool, finished nodes are kept for reuse
+typedef struct pool_job
+{
+    void (*fn)(void *);
+    void *arg;
+    struct pool_job *next;
+} pool_job;
+
+// Fixed set of worker threads pulling jobs from a FIFO
+typedef struct
+{
+    pthread_t *workers;
+    int nworkers;
+    pool_job *head;
+    pool_job *tail;
+    pool_job *spare;
+    // Jobs queued or running
+    int pending;
+    int stopping;
+    // Workers with nothing to do, and pool_wait callers
+    waitqueue idle;
+    waitqueue done;
+} pool;
+
+// Asymmetric coroutine with its own stack, only ever runs inside coro_resume of one thread at a time
+typedef struct coro
+{
+    jmp_buf reg;
+    // Where coro_yield goes back to
+    jmp_buf caller;
+    void *stack;
+    void *(*fn)(void *);
+    void *arg;
+    // Passed by coro_resume to coro_yield and back
+    void *value;
+    int done;
+    // Coroutine that was running when this one was resumed
+    struct coro *resumer;
+} coro;
+
+// Work queued by task_spawn, the group counts the tasks that have not finished yet
+typedef struct
+{
+    int pending;
+    int sleeping;
+    waitqueue waiting;
+} task_group;
+
+#define TASK_GROUP_INITIALIZER {0, 0, {NULL, NULL}}
+
+typedef struct
+{
+    void (*fn)(void *);
+    void *arg;
+    task_group *group;
+} task;
+
+// Work-stealing deque: the owner pushes and takes at the bottom, thieves steal from the top
+#define TASK_DEQUE_SIZE 1024
+typedef struct
+{
+    long top;
+    long bottom;
+    task tasks[TASK_DEQUE_SIZE];
+} taskdeque;
+
 
 void scheduler();
 /*
-    If the current thread is running, change it to ready
+    If the current thread is running, change it to ready and put it on the run queue
     Save the current state if the thread has not exited
-    Find the next ready thread and jump to it
+    Take the next ready thread off the run queue and jump to it
 */
 
 void init_system();
 /*
     Initizalize the necessary system functions on first thread creation
     Set the state of all threads in TCB to be FRESH (unmodified)
-    Set up ualarm and the signal handler to catch it
+    Create the CLOCK_MONOTONIC preemption timer and the signal handler to catch it
+    The time slice defaults to 50ms and can be set with GREEN_QUANTUM_US
+*/
+
+int pthread_detach(pthread_t thread);
+/*
+    Nobody will join the thread: when it exits its stack is freed and its slot reused right away
+    (by the next thread to run, so nothing runs on a freed stack), PTHREAD_CREATE_DETACHED does the same
+    Return ESRCH for a thread that does not exist, EINVAL if it is already detached or being joined
+*/
+
+int pthread_key_create(pthread_key_t *key, void (*destructor)(void *));
+int pthread_key_delete(pthread_key_t key);
+void *pthread_getspecific(pthread_key_t key);
+int pthread_setspecific(pthread_key_t key, const void *value);
+/*
+    Per green thread values, kept in an array in the TCB indexed by key (64 keys)
+    pthread_exit runs the destructors of its non-NULL values
+    pthread_key_create returns EAGAIN once all keys are taken, the others EINVAL for a bad key
+*/
+
+extern thread *green_self;
+static inline void *green_getspecific(pthread_key_t key)
+{
+    return green_self->specific[key];
+}
+/*
+    pthread_getspecific without the call or the range check, the key must come from pthread_key_create
+*/
+
+int pthread_yield();
+int sched_yield();
+/*
+    Give up the CPU, the calling thread goes to the back of the run queue
+    Returns right away if no other thread is READY
+*/
+
+int green_set_preemption(int on);
+/*
+    With preemption off threads only switch when they block, yield or exit: no tick timer,
+    no SIGALRM, and lock()/unlock() skip sigprocmask
+    The scheduler polls file descriptors, timers and signals whenever it runs instead of on the tick
+    Must be called before the first pthread_create or blocking call (return -1 otherwise), GREEN_PREEMPT=0 does the same
+*/
+
+int green_set_deterministic(unsigned long long seed, long checkpoints);
+/*
+    Reproducible scheduling: preemption is off and the next thread is picked at random among the READY ones
+    by a PRNG seeded with seed, so the same seed gives the same interleaving
+    A thread is preempted once it has left the runtime (any call that takes the scheduler lock) checkpoints
+    times in its slice, 0 only switches when it blocks, yields or exits
+    Sleeps, timeouts, I/O and signals still depend on the clock
+    Must be called before the first pthread_create or blocking call (return -1 otherwise), or set GREEN_SEED=seed
+    and optionally GREEN_CHECKPOINTS=checkpoints
+*/
+
+void green_sleep(unsigned long usec);
+/*
+    Sleep for usec microseconds without blocking the other threads
+    The thread is off the run queue, parked in a timer wheel with O(1) insert and cancel
+    The wheel is checked on every tick (so sleeps are as fine as the quantum while others run)
+    and the scheduler sleeps until the earliest timer when nothing else can run
+*/
+
+int green_sigwait(const sigset_t *set, int *sig);
+/*
+    Block the calling thread until one of the signals in set arrives, store it in sig and return 0
+    The signals get a handler that only records them, the scheduler wakes the waiters
+    When no thread is READY the process sleeps (epoll_pwait, pselect or sigsuspend) with the tick off
+    until a file descriptor, a timer, an EDF release or one of these signals can make one READY
+    If nothing can, the blocked threads are listed as a deadlock and the process exits
+*/
+
+int green_trace_start(const char *path);
+void green_trace_stop();
+/*
+    Record scheduler events (switches, create, exit, join, sem_wait, sem_post, block and wake)
+    with TSC timestamps into a ring buffer of the last 1M events, and write them to path as
+    Chrome trace_event JSON (chrome://tracing or Perfetto) on green_trace_stop or at exit
+    GREEN_TRACE=path starts it with the first thread, when off each hook is one untaken branch
+    Return -1 if already tracing or out of memory
+*/
+
+int green_prof_start(const char *path);
+void green_prof_stop();
+/*
+    Sample the running thread on every tick (the tick keeps running while profiling): its PC and up
+    to 32 frames of its frame pointer chain, attributed to the green thread ID
+    On green_prof_stop or at exit the samples are written to path as collapsed stacks
+    ("thread 3;main;work 42"), ready for flamegraph.pl, GREEN_PROF=path starts it with the first thread
+    Names come from backtrace_symbols, so link the program with -rdynamic to see its own functions
+    There are no samples without preemption, return -1 if already profiling or out of memory
+*/
+
+void green_stats_dump(int fd);
+/*
+    Write the scheduler counters to fd: ticks and switches overall, then for every live thread
+    its state, switch-ins, voluntary and involuntary switches, and CPU, READY, BLOCKED and sem_wait time
+    Also written to stderr on SIGUSR1 unless the program installed its own SIGUSR1 handler first
+*/
+
+int green_set_stack_paint(int on);
+long green_stack_used(pthread_t thread);
+/*
+    With painting on, stacks of threads created from then on are filled with a pattern and get
+    a guard page below them, so running off the end stops the process right there with the thread's ID
+    (GREEN_STACK_PAINT=1 does the same), green_stack_used returns how many bytes of a thread's
+    stack have ever been touched, -1 if it was not painted
+    High-water marks of exited threads are also kept as a histogram in green_stats_dump
+    Every stack has a canary word at the bottom checked on each switch and tick, a thread that
+    overflowed its stack aborts the process there
+*/
+
+int green_set_quantum(unsigned long usec);
+/*
+    Change the time slice to usec microseconds (at least 100)
+    The timer only runs while more than one thread is runnable
+    Return -1 if usec is too small
+*/
+
+int green_set_policy(enum greenPolicy policy);
+/*
+    Switch the scheduling policy, GREEN_SCHED_RR by default, GREEN_SCHED_MLFQ or GREEN_SCHED_FAIR
+    Can also be chosen with GREEN_SCHED=mlfq or GREEN_SCHED=fair
+    MLFQ: 4 levels, a thread at level L runs 2^L quanta before it is demoted,
+    blocking moves it up a level and every 100 ticks everyone goes back to the top
+*/
+
+int pthread_setschedprio(pthread_t thread, int prio);
+/*
+    Pin the MLFQ level of a thread, prio 4 is the highest level and 1 the lowest
+    prio 0 unpins it
+    pthread_attr_setschedparam has the same effect at creation, but glibc only accepts a priority there
+    after pthread_attr_setschedpolicy(attr, SCHED_FIFO) or SCHED_RR (EINVAL under SCHED_OTHER)
+*/
+
+int green_set_weight(pthread_t thread, unsigned int weight);
+/*
+    Set the CPU share of a thread under GREEN_SCHED_FAIR, the default weight is 1024
+    The thread with the lowest runtime/weight (virtual runtime) runs next
+    Return -1 for a zero weight
+*/
+
+unsigned long long green_get_runtime(pthread_t thread);
+/*
+    Return the CPU time a thread has used so far in nanoseconds
+*/
+
+int green_set_edf(pthread_t thread, unsigned long period_us, unsigned long budget_us, unsigned long deadline_us);
+/*
+    Move a thread into the earliest-deadline-first class, its first job is released now
+    Every period it may run for budget microseconds and should finish within deadline
+    EDF threads run before (and preempt) all other threads, earliest absolute deadline first
+    Return -1 unless budget <= deadline <= period and the summed budget/deadline stays at most 1
+    Releases and budgets are checked on the tick, so periods should be a multiple of the quantum
+*/
+
+void green_edf_wait();
+/*
+    Called by an EDF thread when its job is done, blocks until the next period
+*/
+
+unsigned long green_edf_misses(pthread_t thread);
+/*
+    Return the number of jobs of an EDF thread that did not finish by their deadline
 */
 
 int pthread_create(pthread_t *thread, const pthread_attr_t *attr, void *(*start_routine)(void *), void *arg);
@@ -66,14 +478,15 @@ int pthread_create(pthread_t *thread, const pthread_attr_t *attr, void *(*start_
     Allocate its stack memory
     Initialize its registers to its function call + args
     >scheduler MAY choose to schedule upon creation of a new thread
+    Return EAGAIN if the stack cannot be allocated
 */
 
 void pthread_exit(void *value_ptr);
 /*
     Terminate the calling thread
-    Change thread status to EXITED
-    Free the stack
-    If there are any more ready threads, call the scheduler
+    Change thread status to WAITING until it is joined
+    Wake up the joining thread, which frees the stack
+    Call the scheduler, the process exits when no threads are left
 */
 
 void pthread_exit_wrapper();
@@ -105,11 +518,16 @@ int pthread_join(pthread_t thread, void **value_ptr);
 /*
     Postpone the execution of the current running thread until the target thread exits
     Handle exit codes in some way
+    The thread's stack is freed and its slot goes back to pthread_create, joining it again returns ESRCH
+    Return EINVAL for a detached thread and EDEADLK for the calling thread
 */
 
 int sem_init(sem_t *sem, int pshared, unsigned value);
 /*
     Initialize the semaphore referred to by sem
+    With pshared set, sem must be in memory shared by the processes using it (MAP_SHARED)
+    Uncontended wait and post are one atomic, a blocked wait sleeps in the kernel on a futex
+    once no other thread of its process can run
 */
 
 int sem_wait(sem_t *sem);
@@ -119,10 +537,15 @@ int sem_wait(sem_t *sem);
     if sem = 0 : block until it is possible to decrement
 */
 
+int sem_timedwait(sem_t *sem, const struct timespec *abstime);
+/*
+    sem_wait that gives up at abstime (CLOCK_REALTIME), returning -1 with errno ETIMEDOUT
+*/
+
 int sem_post(sem_t *sem);
 /*
     Increment the semaphore pointed to by sem
-    if sem > 0 : wake up another thread thats waiting for it
+    if a thread is waiting : hand it the increment and put it on the run queue, first come first served
 */
 
 int sem_destroy(sem_t *sem);
@@ -131,4 +554,160 @@ int sem_destroy(sem_t *sem);
 
 */
 
+int green_sem_handoff(sem_t *sem, int on);
+/*
+    With handoff on, sem_post switches straight to the thread it wakes instead of
+    leaving it on the run queue, the poster goes back on the run queue
+*/
+
+int pthread_mutex_init(pthread_mutex_t *mutex, const pthread_mutexattr_t *attr);
+int pthread_mutex_destroy(pthread_mutex_t *mutex);
+int pthread_mutex_lock(pthread_mutex_t *mutex);
+int pthread_mutex_trylock(pthread_mutex_t *mutex);
+int pthread_mutex_unlock(pthread_mutex_t *mutex);
+/*
+    Mutex on the green scheduler, PTHREAD_MUTEX_INITIALIZER works as well
+    Normal, recursive and error checking types are supported through the attr
+    Locking a free mutex and unlocking one nobody waits for is a single atomic, no syscall
+    Contended lockers block in a FIFO wait queue
+*/
+
+int pthread_cond_init(pthread_cond_t *cond, const pthread_condattr_t *attr);
+int pthread_cond_destroy(pthread_cond_t *cond);
+int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex);
+int pthread_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex, const struct timespec *abstime);
+int pthread_cond_signal(pthread_cond_t *cond);
+int pthread_cond_broadcast(pthread_cond_t *cond);
+/*
+    Condition variable, waiters are woken in FIFO order
+    Signalling a condition nobody waits on costs no syscall
+*/
+
+int pthread_rwlock_init(pthread_rwlock_t *rwlock, const pthread_rwlockattr_t *attr);
+int pthread_rwlock_destroy(pthread_rwlock_t *rwlock);
+int pthread_rwlock_rdlock(pthread_rwlock_t *rwlock);
+int pthread_rwlock_tryrdlock(pthread_rwlock_t *rwlock);
+int pthread_rwlock_wrlock(pthread_rwlock_t *rwlock);
+int pthread_rwlock_trywrlock(pthread_rwlock_t *rwlock);
+int pthread_rwlock_unlock(pthread_rwlock_t *rwlock);
+/*
+    Read-write lock that prefers writers: new readers wait while a writer is waiting
+*/
+
+int green_wait(int *addr, int expected);
+/*
+    Park the calling thread until green_wake is called on addr, like FUTEX_WAIT
+    Return -1 right away if *addr no longer equals expected, 0 once woken
+    Waiters are kept in a hash table of wait queues keyed by address
+*/
+
+int green_wake(int *addr, int n);
+/*
+    Wake up to n threads parked on addr in FIFO order, return how many were woken
+    Costs no syscall when nobody is parked on an address in the same bucket
+*/
+
+ssize_t green_read(int fd, void *buf, size_t count);
+ssize_t green_write(int fd, const void *buf, size_t count);
+int green_accept(int fd, struct sockaddr *addr, socklen_t *addrlen);
+/*
+    read, write and accept that only block the calling green thread
+    The fd is switched to O_NONBLOCK, on EAGAIN the thread parks until epoll reports the fd ready
+    Ready fds are picked up on every tick, and the scheduler waits in epoll_wait when nothing else can run
+    Accepted connections are non-blocking, fds must be below 65536
+    Return -1 with errno set if the fd cannot be watched (no epoll instance or out of memory)
+*/
+
+chan *chan_make(unsigned cap, size_t elem_size);
+void chan_destroy(chan *ch);
+/*
+    Create a channel of elem_size byte values with room for cap of them, 0 makes it unbuffered
+    Return NULL if out of memory
+*/
+
+int chan_send(chan *ch, const void *elem);
+int chan_recv(chan *ch, void *elem);
+/*
+    Copy elem_size bytes into or out of the channel, blocking while it is full or empty
+    A waiting receiver gets the value copied straight into its elem without going through the buffer,
+    a receiver takes a waiting sender's value straight from the sender
+    chan_send returns -1 on a closed channel, chan_recv returns -1 (and zeroes elem) once a closed
+    channel is drained, elem may be NULL to throw the value away
+*/
+
+int chan_select(chan_case *cases, int n, int block);
+/*
+    Perform whichever of the n sends and receives can go first and return its index
+    Cases that can go right away are tried in order, otherwise the thread waits on all the channels
+    Without block it returns -1 instead of waiting, the chosen case's ok is 0 if its channel was closed
+*/
+
+int chan_close(chan *ch);
+/*
+    Close a channel: waiting receivers get zeroes and waiting senders an error
+    Values already buffered can still be received, return -1 if it was already closed
+*/
+
+int task_pool_init(int workers);
+void task_pool_shutdown();
+/*
+    Start workers green threads to run tasks, the first task_spawn starts 4 if this was not called
+    task_pool_shutdown lets them finish what is queued and joins them
+*/
+
+void task_spawn(task_group *g, void (*fn)(void *), void *arg);
+void task_sync(task_group *g);
+/*
+    Queue fn(arg) as part of group g (set to TASK_GROUP_INITIALIZER) and wait for the whole group
+    Tasks go on the spawning thread's own deque without taking a lock, idle workers steal the oldest
+    while the owner runs the newest, a full deque runs the task right away
+    task_sync runs queued tasks itself and only blocks while the group's last tasks run elsewhere
+*/
+
+void parallel_for(long begin, long end, long grain, void (*body)(long lo, long hi, void *arg), void *arg);
+/*
+    Call body over [begin, end) in pieces of at most grain, splitting the range in half
+    recursively so idle workers steal the big halves, return once every piece is done
+*/
+
+pool *pool_create(int n);
+void pool_destroy(pool *p);
+/*
+    Start n long-lived worker threads, pool_destroy waits for the queued jobs and joins them
+    Return NULL if no worker could be created
+*/
+
+int pool_submit(pool *p, void (*fn)(void *), void *arg);
+void pool_wait(pool *p);
+/*
+    Queue fn(arg) for the next free worker, workers park on the pool while the queue is empty
+    No stack or TCB setup per job, the queue nodes are reused, return -1 if out of memory
+    pool_wait blocks until every job submitted so far has finished
+*/
+
+coro *coro_create(void *(*fn)(void *), void *arg);
+void coro_destroy(coro *co);
+/*
+    Create a coroutine that runs fn(arg) on its own stack the first time it is resumed
+    Return NULL if out of memory
+*/
+
+void *coro_resume(coro *co, void *value);
+void *coro_yield(void *value);
+int coro_done(coro *co);
+/*
+    coro_resume runs the coroutine until it yields or fn returns, and returns the value it yielded
+    (or fn's return value), coro_yield returns the value passed to the next coro_resume
+    Switching is a setjmp/longjmp pair: no signal mask changes and no scheduler, the coroutine
+    runs as part of the thread that resumed it and can still be preempted along with it
+    Resuming a finished coroutine returns NULL, coro_done says whether fn has returned
+*/
+
+int pthread_barrier_init(pthread_barrier_t *barrier, const pthread_barrierattr_t *attr, unsigned count);
+int pthread_barrier_destroy(pthread_barrier_t *barrier);
+int pthread_barrier_wait(pthread_barrier_t *barrier);
+/*
+    Barrier for count threads, the last one to arrive gets PTHREAD_BARRIER_SERIAL_THREAD
+*/
+
 #endif
\ No newline at end of file